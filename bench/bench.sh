@@ -0,0 +1,39 @@
+#!/bin/sh
+# Times pst on synthetic procfs trees of 1k, 10k and 100k processes.
+#
+# Usage: bench/bench.sh [threads per process] [pst options...]
+#
+# Set BENCH_DIR to place the fixtures on e.g. a tmpfs, and BENCH_SIZES to
+# override the process counts. Fixtures are kept for the next run.
+
+set -e
+
+SRC=$(cd "$(dirname "$0")/.." && pwd)
+DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/pst-bench}
+SIZES=${BENCH_SIZES:-1000 10000 100000}
+RUNS=${BENCH_RUNS:-3}
+CXX=${CXX:-g++}
+
+THREADS=${1:-2}
+[ $# -gt 0 ] && shift
+
+mkdir -p "$DIR"
+
+$CXX -std=c++20 -O2 -o "$DIR/pst" "$SRC/pst.cpp"
+$CXX -std=c++20 -O2 -o "$DIR/mkprocfs" "$SRC/bench/mkprocfs.cpp"
+
+for n in $SIZES; do
+	fixture="$DIR/$n-$THREADS"
+
+	if [ ! -e "$fixture/proc/uptime" ]; then
+		echo "Generating $n processes with $THREADS threads each"
+		rm -rf "$fixture"
+		"$DIR/mkprocfs" "$fixture" "$n" "$THREADS"
+	fi
+
+	i=1
+	while [ $i -le "$RUNS" ]; do
+		"$DIR/pst" --proc-root "$fixture/proc" -o all --timings "$@" >/dev/null
+		i=$((i + 1))
+	done
+done
@@ -0,0 +1,287 @@
+// Writes a synthetic procfs tree to benchmark pst with --proc-root.
+//
+// Usage: mkprocfs <dir> <processes> [threads per process]
+//
+// Creates <dir>/proc with the files pst reads (stat, status, smaps_rollup,
+// statm, io, cmdline, comm, and task/<tid>/ for every thread), <dir>/proc/uptime,
+// and <dir>/sys/dev/char for the tty lookup.
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static mt19937 rng(1);
+
+static long rand(long min, long max)
+{
+    return uniform_int_distribution<long>(min, max)(rng);
+}
+
+static int makeDir(const string &path)
+{
+    if (mkdir(path.c_str(), 0755) && errno != EEXIST)
+    {
+        cerr << "ERR: Failed to create " << path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int writeFile(const string &path, const string &content)
+{
+    FILE *file = fopen(path.c_str(), "w");
+
+    if (!file || fwrite(content.data(), 1, content.length(), file) != content.length())
+    {
+        cerr << "ERR: Failed to write " << path << ": " << strerror(errno) << endl;
+        if (file)
+            fclose(file);
+        return 1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+struct Proc
+{
+    int pid, ppid, pgid, sid, tty;
+    int uid;
+    string comm;
+    vector<string> args;
+    long startTime; // clock ticks after boot
+    bool kernel = false;
+};
+
+static const char *COMMS[] = {"bash", "sshd", "java", "python3", "node", "nginx", "postgres", "chrome", "systemd", "sleep"};
+static const char *KCOMMS[] = {"kworker/0:1", "ksoftirqd/0", "rcu_preempt", "migration/0", "kswapd0"};
+
+static string statFile(const Proc &p, int tid, const string &comm, int threads)
+{
+    long utime = rand(0, 100000), stime = rand(0, 20000);
+
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+             "%d (%s) S %d %d %d %d -1 4194560 %ld 0 %ld 0 %ld %ld 0 0 20 0 %d 0 %ld %ld %ld "
+             "18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 %ld 0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+             tid, comm.c_str(), p.ppid, p.pgid, p.sid, p.tty, rand(100, 1000000), rand(0, 500),
+             utime, stime, threads, p.startTime, rand(1L << 20, 1L << 34), rand(100, 100000), rand(0, 63));
+
+    return buf;
+}
+
+static string statusFile(const Proc &p, int tid, const string &comm, int threads)
+{
+    long rss = rand(1000, 2000000);
+
+    char buf[2048];
+    snprintf(buf, sizeof(buf),
+             "Name:\t%s\nUmask:\t0022\nState:\tS (sleeping)\nTgid:\t%d\nNgid:\t0\nPid:\t%d\nPPid:\t%d\n"
+             "TracerPid:\t0\nUid:\t%d\t%d\t%d\t%d\nGid:\t%d\t%d\t%d\t%d\nFDSize:\t64\nGroups:\t%d\n"
+             "NStgid:\t%d\nNSpid:\t%d\nNSpgid:\t%d\nNSsid:\t%d\nKthread:\t0\nVmPeak:\t%ld kB\nVmSize:\t%ld kB\n"
+             "VmLck:\t0 kB\nVmPin:\t0 kB\nVmHWM:\t%ld kB\nVmRSS:\t%ld kB\nRssAnon:\t%ld kB\nRssFile:\t%ld kB\n"
+             "RssShmem:\t0 kB\nVmData:\t%ld kB\nVmStk:\t132 kB\nVmExe:\t904 kB\nVmLib:\t4096 kB\nVmPTE:\t120 kB\n"
+             "VmSwap:\t%ld kB\nHugetlbPages:\t0 kB\nCoreDumping:\t0\nTHP_enabled:\t1\nThreads:\t%d\n"
+             "SigQ:\t0/63448\nSigPnd:\t0000000000000000\nShdPnd:\t0000000000000000\nSigBlk:\t0000000000010000\n"
+             "SigIgn:\t0000000000380004\nSigCgt:\t000000004b817efb\nCapInh:\t0000000000000000\n"
+             "CapPrm:\t0000000000000000\nCapEff:\t0000000000000000\nCapBnd:\t000001ffffffffff\n"
+             "CapAmb:\t0000000000000000\nNoNewPrivs:\t0\nSeccomp:\t0\nSeccomp_filters:\t0\n"
+             "Speculation_Store_Bypass:\tthread vulnerable\nCpus_allowed:\tff\nCpus_allowed_list:\t0-7\n"
+             "Mems_allowed:\t00000001\nMems_allowed_list:\t0\nvoluntary_ctxt_switches:\t%ld\n"
+             "nonvoluntary_ctxt_switches:\t%ld\n",
+             comm.c_str(), p.pid, tid, p.ppid, p.uid, p.uid, p.uid, p.uid, p.uid, p.uid, p.uid, p.uid, p.uid,
+             tid, tid, p.pgid, p.sid, rss * 4, rss * 3, rss + 100, rss, rss / 2, rss / 2, rss * 2,
+             rand(0, 1) ? 0 : rand(0, 100000), threads, rand(0, 100000), rand(0, 1000));
+
+    return buf;
+}
+
+static string smapsRollupFile(long &rss)
+{
+    rss = rand(1000, 2000000);
+    long pss = rss / rand(1, 4);
+
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+             "55d5e4a0e000-7ffc3d5fe000 ---p 00000000 00:00 0                          [rollup]\n"
+             "Rss:            %8ld kB\nPss:            %8ld kB\nPss_Dirty:      %8ld kB\n"
+             "Pss_Anon:       %8ld kB\nPss_File:       %8ld kB\nPss_Shmem:             0 kB\n"
+             "Shared_Clean:   %8ld kB\nShared_Dirty:          0 kB\nPrivate_Clean:  %8ld kB\n"
+             "Private_Dirty:  %8ld kB\nReferenced:     %8ld kB\nAnonymous:      %8ld kB\nKSM:                   0 kB\n"
+             "LazyFree:              0 kB\nAnonHugePages:         0 kB\nShmemPmdMapped:        0 kB\n"
+             "FilePmdMapped:         0 kB\nShared_Hugetlb:        0 kB\nPrivate_Hugetlb:       0 kB\n"
+             "Swap:           %8ld kB\nSwapPss:        %8ld kB\nLocked:                0 kB\n",
+             rss, pss, pss / 2, pss / 2, pss / 2, rss - pss, pss / 2, pss / 2, rss, pss / 2,
+             rand(0, 10000), rand(0, 5000));
+
+    return buf;
+}
+
+static string ioFile()
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "rchar: %ld\nwchar: %ld\nsyscr: %ld\nsyscw: %ld\nread_bytes: %ld\nwrite_bytes: %ld\n"
+             "cancelled_write_bytes: %ld\n",
+             rand(0, 1L << 34), rand(0, 1L << 34), rand(0, 1000000), rand(0, 1000000),
+             rand(0, 1L << 32), rand(0, 1L << 32), rand(0, 1L << 20));
+
+    return buf;
+}
+
+static int writeTask(const string &dir, const Proc &p, int tid, int threads, bool kernel)
+{
+    string comm = tid == p.pid ? p.comm : p.comm.substr(0, 10) + "-" + to_string(tid - p.pid);
+
+    if (makeDir(dir) ||
+        writeFile(dir + "/stat", statFile(p, tid, comm, threads)) ||
+        writeFile(dir + "/status", statusFile(p, tid, comm, threads)) ||
+        writeFile(dir + "/comm", comm + "\n") ||
+        writeFile(dir + "/io", ioFile()))
+        return 1;
+
+    string cmdline;
+
+    if (!kernel)
+    {
+        for (const string &arg : p.args)
+            cmdline += arg + '\0';
+    }
+
+    if (writeFile(dir + "/cmdline", cmdline))
+        return 1;
+
+    // Kernel threads have no memory.
+    long rss = 0;
+
+    if (writeFile(dir + "/smaps_rollup", kernel ? "" : smapsRollupFile(rss)))
+        return 1;
+
+    // In 4 KB pages, resident matches the Rss in smaps_rollup.
+    return writeFile(dir + "/statm", kernel ? "0 0 0 0 0 0 0\n" : to_string(rss) + " " + to_string(rss / 4) + " " + to_string(rss / 16) + " 226 0 " + to_string(rss / 2) + " 0\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 4)
+    {
+        cerr << "Usage: mkprocfs <dir> <processes> [threads per process]" << endl;
+        return 1;
+    }
+
+    string root = argv[1];
+    int count = atoi(argv[2]), threads = argc == 4 ? atoi(argv[3]) : 1;
+
+    if (count < 3 || threads < 1)
+    {
+        cerr << "ERR: At least 3 processes and 1 thread required" << endl;
+        return 1;
+    }
+
+    string proc = root + "/proc", sys = root + "/sys";
+
+    if (makeDir(root) || makeDir(proc) || makeDir(sys) || makeDir(sys + "/dev") || makeDir(sys + "/dev/char"))
+        return 1;
+
+    // Uptime of 10 days, all processes started in the first 9.
+    long uptime = 10 * 24 * 60 * 60;
+
+    if (writeFile(proc + "/uptime", to_string(uptime) + ".00 " + to_string(uptime * 7) + ".00\n"))
+        return 1;
+
+    // A few serial ttys which are not known by pst, and need a sysfs lookup.
+    for (int i = 0; i < 4; i++)
+    {
+        string dev = sys + "/dev/char/204:" + to_string(64 + i);
+
+        if (makeDir(dev) || writeFile(dev + "/uevent", "MAJOR=204\nMINOR=" + to_string(64 + i) + "\nDEVNAME=ttyAMA" + to_string(i) + "\n"))
+            return 1;
+    }
+
+    // Pids are allocated sequentially, threads take the pids after their
+    // process. init and kthreadd are single threaded, so that kthreadd is 2.
+    vector<Proc> procs;
+    int pid = 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        Proc p;
+        p.pid = pid;
+        p.uid = rand(0, 3) ? 0 : rand(1000, 1010);
+        p.startTime = i < 2 ? 1 : rand(1, 9L * 24 * 60 * 60 * 100);
+
+        bool &kernel = p.kernel;
+
+        if (i == 0)
+        {
+            p.ppid = 0;
+            p.comm = "systemd";
+            p.args = {"/sbin/init", "splash"};
+        }
+        else if (i == 1)
+        {
+            p.ppid = 0;
+            p.comm = "kthreadd";
+            kernel = true;
+        }
+        else if (rand(0, 9) == 0)
+        {
+            // Kernel thread
+            p.ppid = procs[1].pid;
+            p.comm = KCOMMS[rand(0, size(KCOMMS) - 1)];
+            kernel = true;
+        }
+        else
+        {
+            // Mostly children of init, the rest build deeper trees.
+            const Proc &parent = procs[rand(0, 2) ? 0 : rand(0, i - 1)];
+            p.ppid = parent.kernel ? procs[0].pid : parent.pid;
+            p.comm = COMMS[rand(0, size(COMMS) - 1)];
+
+            p.args.push_back("/usr/bin/" + p.comm);
+            for (long j = rand(0, 6); j > 0; j--)
+                p.args.push_back("--option-" + to_string(j) + "=" + to_string(rand(0, 1000000)));
+        }
+
+        if (kernel || i == 0)
+        {
+            p.uid = 0;
+            p.pgid = p.sid = i == 0;
+            p.tty = 0;
+        }
+        else
+        {
+            p.pgid = rand(0, 1) ? p.pid : p.ppid;
+            p.sid = rand(0, 1) ? p.pgid : 1;
+
+            // No tty, a pts, or a serial tty.
+            long tty = rand(0, 9);
+            p.tty = tty < 7 ? 0 : (tty < 9 ? (136 << 8 | rand(0, 20)) : (204 << 8 | (64 + rand(0, 3))));
+        }
+
+        procs.push_back(p);
+
+        string dir = proc + "/" + to_string(p.pid);
+        int taskThreads = kernel || i == 0 ? 1 : threads;
+        pid += taskThreads;
+
+        if (writeTask(dir, p, p.pid, taskThreads, kernel) || makeDir(dir + "/task"))
+            return 1;
+
+        for (int t = 0; t < taskThreads; t++)
+        {
+            if (writeTask(dir + "/task/" + to_string(p.pid + t), p, p.pid + t, taskThreads, kernel))
+                return 1;
+        }
+    }
+
+    return 0;
+}
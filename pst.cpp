@@ -1,4 +1,4 @@
-// For DIR, opendir()
+// For DT_DIR, DT_UNKNOWN
 #include <dirent.h>
 
 // For getopt_long() option.
@@ -7,14 +7,14 @@
 // Standard I/O streams.
 #include <iostream>
 
-// For read(), close(), sysconf()
+// For read(), close(), sysconf(), syscall()
 #include <unistd.h>
 
-// For open()
+// For open(), openat()
 #include <fcntl.h>
 
-// For ifstream
-#include <fstream>
+// For SYS_getdents64
+#include <sys/syscall.h>
 
 // For uptime
 #include <sys/sysinfo.h>
@@ -23,6 +23,7 @@
 #include <list>
 #include <set>
 #include <map>
+#include <algorithm>
 
 // For strerror(), strtok(), strcmp(), strchr(), strstr()
 #include <string.h>
@@ -30,21 +31,11 @@
 // For ioctl()
 #include <sys/ioctl.h>
 
-#ifdef ANDROID
-
-// For stringstream
+// For ostringstream
 #include <sstream>
 
-#else
-
-// For setw(), wstring_convert(), ostringstream, setprecision()
-#include <iomanip>
-
-#endif
-
-// For codecvt_utf8_utf16
-// Tree art unicode characters length measurement.
-#include <codecvt>
+// For to_chars()
+#include <charconv>
 
 // For device major / minor numbers.
 #include <linux/kdev_t.h>
@@ -52,21 +43,101 @@
 // For user name.
 #include <pwd.h>
 
+// For parallel /proc scan.
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// For sampling interval.
+#include <chrono>
+
+// For watch mode.
+#include <signal.h>
+#include <poll.h>
+
+// For process events connector.
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+// For taskstats.
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+
+// For snapshots.
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
+
+// For interned strings.
+#include <unordered_set>
+#include <string_view>
+
+// For strptime(), mktime() with --at.
+#include <time.h>
+
+// For --match regex.
+#include <regex.h>
+
+// For --daemon and --listen.
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 using namespace std;
 
 /////////////////////////////////////////////////////////////////////////
 
 #define VERSION "v0.3"
 
+// Output is collected here and written to cout in large chunks, instead
+// of flushing every line. In watch mode cout is redirected to the frame.
+static char outBuf[1 << 18];
+static size_t outLen = 0;
+
+static void flushOut()
+{
+    cout.write(outBuf, outLen);
+    outLen = 0;
+}
+
+static void putOut(const char *s, size_t len)
+{
+    if (outLen + len > sizeof(outBuf))
+    {
+        flushOut();
+
+        if (len > sizeof(outBuf))
+        {
+            cout.write(s, len);
+            return;
+        }
+    }
+
+    memcpy(outBuf + outLen, s, len);
+    outLen += len;
+}
+
+static void putOut(const string &s)
+{
+    putOut(s.data(), s.length());
+}
+
 static int printErr(string msg)
 {
+    // Keep the order with the buffered output.
+    flushOut();
     cerr << "ERR: " << msg << endl;
     return 1;
 }
 
 static int printErrCode(string msg)
 {
-    cerr << "ERR: " << msg << ": " << strerror(errno) << endl;
+    int err = errno;
+    flushOut();
+    cerr << "ERR: " << msg << ": " << strerror(err) << endl;
     return 1;
 }
 
@@ -93,6 +164,101 @@ static bool isNumber(string num, string type, bool verbose)
     return true;
 }
 
+// 500ms, 5s, 10m or 1h. Seconds if there's no unit.
+static long long parseDuration(const string &str)
+{
+    size_t digits = 0;
+    while (digits < str.length() && isdigit(str[digits]))
+        digits++;
+
+    if (!digits || digits > 9)
+        return -1;
+
+    long long num = stoll(str.substr(0, digits));
+    string unit = str.substr(digits);
+
+    if (unit == "ms")
+        return num;
+    if (unit.empty() || unit == "s")
+        return num * 1000;
+    if (unit == "m")
+        return num * 60 * 1000;
+    if (unit == "h")
+        return num * 60 * 60 * 1000;
+
+    return -1;
+}
+
+// Bytes, or with K, M or G suffix.
+static long long parseSize(const string &str)
+{
+    size_t digits = 0;
+    while (digits < str.length() && isdigit(str[digits]))
+        digits++;
+
+    if (!digits || digits > 12)
+        return -1;
+
+    long long num = stoll(str.substr(0, digits));
+    string unit = str.substr(digits);
+
+    if (unit.empty())
+        return num;
+    if (unit == "K" || unit == "k")
+        return num << 10;
+    if (unit == "M" || unit == "m")
+        return num << 20;
+    if (unit == "G" || unit == "g")
+        return num << 30;
+
+    return -1;
+}
+
+// Unix time in sec, "YYYY-MM-DD HH:MM[:SS]" in local time, or -<duration>
+// before now. Returns unix time in millisec.
+static long long parseTime(const string &str)
+{
+    if (str.empty())
+        return -1;
+
+    if (str[0] == '-')
+    {
+        long long ago = parseDuration(str.substr(1));
+        long long now = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        return ago < 0 ? -1 : now - ago;
+    }
+
+    if (isNumber(str, "time", false))
+        return str.length() > 12 ? -1 : stoll(str) * 1000;
+
+    for (const char *format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M"})
+    {
+        struct tm tm = {};
+        const char *end = strptime(str.c_str(), format, &tm);
+
+        if (end && !*end)
+        {
+            tm.tm_isdst = -1;
+            time_t t = mktime(&tm);
+            return t == -1 ? -1 : t * 1000LL;
+        }
+    }
+
+    return -1;
+}
+
+static string formatTime(long long ms)
+{
+    time_t t = ms / 1000;
+    struct tm tm;
+    char buf[32];
+
+    if (!localtime_r(&t, &tm) || !strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm))
+        return to_string(t);
+
+    return buf;
+}
+
 static int showUsage()
 {
     cout << endl
@@ -102,12 +268,42 @@ static int showUsage()
          << endl
          << "Options:\n"
          << "\t-o, --opt <opt,...>   Print only given columns (see below)\n"
+         << "\t-j, --jobs <N>        Read procfs with N threads (default: online CPUs)\n"
          << "\t--kernel              Show kernel threads\n"
          << "\t--threads             Show process threads\n"
          << "\t--rss                 Show RSS RAM and SWAP instead of PSS\n"
+         << "\t--mem <src>           Read RAM and SWAP from statm (RSS only), rollup or smaps (default: auto)\n"
          << "\t--cpu-time            Show CPU time instead of percentage\n"
          << "\t--total-io            Include I/O of dead threads and dead child processes\n"
+         << "\t--cumulative          Show RAM, SWAP, CPU and I/O of the whole subtree\n"
+         << "\t--taskstats           Get per thread I/O from taskstats netlink instead of procfs *\n"
+         << "\t--interval <ms>       Show CPU, I/O and faults per second over the interval\n"
+         << "\t--watch <ms>          Redraw every <ms>, with per second CPU, I/O and faults\n"
+         << "\t--mem-refresh <ms>    Re-read RAM and SWAP every <ms> in watch or daemon mode (default: 10000)\n"
+         << "\t--events              Track fork, exec and exit through netlink in watch mode *\n"
+         << "\t--proc-root <dir>     Read procfs from <dir> instead of /proc\n"
+         << "\t--timings             Print time spent in scan, tree build and render to stderr\n"
+         << "\t--save <file>         Save all columns of all processes to <file> and exit\n"
+         << "\t--load <file>         Print the processes saved with --save or --record instead of reading procfs\n"
+         << "\t--record <file>       Append a frame of all processes to <file> until interrupted\n"
+         << "\t--every <duration>    Time between the frames with --record (default: 5s)\n"
+         << "\t--max-size <size>     Overwrite the oldest frames beyond <size> with --record (default: 64M)\n"
+         << "\t--at <time>           Print the last frame recorded at or before <time> with --load\n"
+         << "\t--daemon              Keep all processes in memory and answer --connect until interrupted\n"
+         << "\t--socket <path>       Listen on the Unix socket <path> with --daemon\n"
+         << "\t--refresh <duration>  Time between the refreshes with --daemon or --listen (default: 2s)\n"
+         << "\t--connect <path>      Print the processes kept by the daemon at <path> instead of reading procfs\n"
+         << "\t--rescan              Make the daemon read procfs again before answering --connect\n"
+         << "\t--exporter            Print RAM, SWAP, CPU and I/O per group in Prometheus text format\n"
+         << "\t--group <key>         Group by cgroup, or by root (children of pid args, default: 1) or uid with --exporter\n"
+         << "\t--no-procs            Print only the cgroups with --group cgroup, without reading the processes\n"
+         << "\t--listen <addr>       Serve --exporter over HTTP on a Unix socket path or loopback host:port\n"
+         << "\t--format <fmt>        Print raw values as jsonl, csv or tsv, with the tree depth\n"
+         << "\t--sort <col>          Order siblings by pid, uid, ram, swap, cpu, age, io, flt or cmd\n"
+         << "\t--top <N>             Print only the first N processes by --sort, with their ancestors\n"
          << "\t--no-tree             Print only given processes, not their child tree\n"
+         << "\t--ancestors           Print given processes with their parents up to init, not their child tree\n"
+         << "\t--match <mode>        Match cmd arguments as sub(string), prefix, exact or regex (default: sub)\n"
          << "\t--no-full             Match only the cmd part before first space, not the whole cmdline\n"
          << "\t--no-pid              Treat the numerical argument(s) as cmd, not pid\n"
          << "\t--no-name             Do not try to resolve uid to user name\n"
@@ -118,9 +314,12 @@ static int showUsage()
          << "\t-V, --version         Show version\n"
          << "\t-h, --help            This help message\n"
          << endl
-         << "\tColumns: all, ppid, pgid, sid, pid, tty, uid, ram*, swap*, cpu, age, io*, cmd\n"
+         << "\tColumns: all, ppid, pgid, sid, pid, tty, uid, ram*, swap*, cpu, age, io*, flt, cmd\n"
+         << endl
+         << "\tDurations: 500ms, 5s, 10m, 1h. Sizes: 4096, 512K, 64M, 1G.\n"
+         << "\tTimes: unix time, 'YYYY-MM-DD HH:MM[:SS]' in local time, or -<duration> ago.\n"
          << endl
-         << "\t* Required capabilities: setcap cap_sys_ptrace,cap_dac_read_search+ep\n"
+         << "\t* Required capabilities: setcap cap_sys_ptrace,cap_dac_read_search+ep (cap_net_admin for --events and --taskstats)\n"
          << endl;
 
     return 1;
@@ -128,6 +327,93 @@ static int showUsage()
 
 /////////////////////////////////////////////////////////////////////////
 
+// Strings shared by many processes (cmdlines, tty, user and cgroup names)
+// are stored once, in arena blocks, and equal strings have equal handles.
+// A one-shot run never frees the blocks. The long-running modes rebuild
+// the arena from the live handles with compactStrings(). The store is
+// split into shards, each with its own lock, for the parallel scan.
+static constexpr size_t INTERN_SHARDS = 16, INTERN_BLOCK = 64 * 1024;
+
+struct InternShard
+{
+    mutex lock;
+    unordered_set<string_view> strings;
+    char *block = nullptr;
+    size_t blockLeft = 0;
+    vector<char *> blocks;
+    size_t bytes = 0; // Of all the blocks
+};
+
+static InternShard internShards[INTERN_SHARDS];
+
+// Each string is preceded by its length, and followed by a '\0'.
+alignas(uint32_t) static const char EMPTY_STR[sizeof(uint32_t) + 1] = {};
+
+static const char *internStr(string_view str)
+{
+    if (str.empty())
+        return EMPTY_STR + sizeof(uint32_t);
+
+    InternShard &shard = internShards[hash<string_view>()(str) % INTERN_SHARDS];
+    lock_guard<mutex> lock(shard.lock);
+
+    auto it = shard.strings.find(str);
+    if (it != shard.strings.end())
+        return it->data();
+
+    // Keeps the length prefix of the next string aligned.
+    size_t size = (sizeof(uint32_t) + str.length() + 1 + alignof(uint32_t) - 1) & ~(alignof(uint32_t) - 1);
+
+    // A long string gets a block of its own.
+    if (size > shard.blockLeft)
+    {
+        shard.blockLeft = max(size, INTERN_BLOCK);
+        shard.block = new char[shard.blockLeft];
+        shard.blocks.push_back(shard.block);
+        shard.bytes += shard.blockLeft;
+    }
+
+    uint32_t len = str.length();
+    char *data = shard.block + sizeof(uint32_t);
+
+    memcpy(shard.block, &len, sizeof(len));
+    memcpy(data, str.data(), len);
+    data[len] = '\0';
+
+    shard.block += size;
+    shard.blockLeft -= size;
+
+    shard.strings.insert({data, len});
+    return data;
+}
+
+// Handle to an interned string, copied and compared as a pointer.
+class IStr
+{
+    const char *data;
+
+public:
+    IStr(string_view str = {}) : data(internStr(str)) {}
+    IStr(const char *str) : IStr(string_view(str)) {}
+    IStr(const string &str) : IStr(string_view(str)) {}
+
+    const char *c_str() const { return data; }
+
+    size_t length() const
+    {
+        uint32_t len;
+        memcpy(&len, data - sizeof(len), sizeof(len));
+        return len;
+    }
+
+    string_view view() const { return {data, length()}; }
+    operator string_view() const { return view(); }
+
+    bool operator==(const IStr &other) const { return data == other.data; }
+};
+
+static IStr NO_TTY = "?", DASH = "-";
+
 struct Proc
 {
     bool failed = false;
@@ -139,9 +425,11 @@ struct Proc
 
     // stat
     int ppid = -1, pgid = -1, sid = -1;
-    string tty = "?";
-    long cpuTime = -1; // millisec
-    long age = -1;     // millisec
+    IStr tty = NO_TTY;
+    long minFlt = -1, majFlt = -1;
+    long cpuTime = -1;        // millisec
+    long long startTime = -1; // clock ticks after boot
+    long age = -1;            // millisec
 
     // status
     uid_t uid = -1;
@@ -151,17 +439,48 @@ struct Proc
     long swapPss = -1; // bytes
 
     // cmdline (or comm for threads and kernel threads)
-    string cmdline = "-";
+    IStr cmdline = DASH;
+    int cmdMatch = -1; // Matched the cmd arguments while reading, -1 if not checked
+
+    // cgroup v2 path, with --group cgroup
+    IStr cgroup;
 
     // io
     long long readIO = -1;  // bytes
     long long writeIO = -1; // bytes
+
+    // Change since the previous sample (--interval)
+    long long sampleTime = 0; // nanosec, CLOCK_MONOTONIC
+    long sampleMs = -1;       // -1 if there's no previous sample
+    long cpuDelta = 0;
+    long long readDelta = 0, writeDelta = 0;
+    long minFltDelta = 0, majFltDelta = 0;
+
+    // Sums over the process and its descendants (--cumulative)
+    long subPss = -1, subSwapPss = -1;
+    long subCpuTime = -1, subCpuDelta = 0;
+    long long subReadIO = -1, subWriteIO = -1;
+    long long subReadDelta = 0, subWriteDelta = 0;
+
+    // With --threads, in task order
+    vector<Proc> threads;
 };
 
-static map<pid_t, Proc> procMap;
-static map<pid_t, list<Proc>> childMap;
+// Processes are kept in a contiguous table, in /proc order. Pids are
+// mapped to rows with open addressing. The rows past the table are the
+// parents which are not in it (e.g. pid 0). Children of a row are the
+// table indices childRows[childStart[row]] to childRows[childStart[row + 1] - 1].
+static vector<Proc> procTable;
+static vector<int> pidIndex;
+static vector<pid_t> rowPids;
+static vector<int> childStart, childRows;
+
+// Rows which have children, sorted by pid.
+static vector<int> rootRows;
+
 static map<pid_t, string> errMap;
 
+// The options are set to their defaults in resetOpts().
 static int col_wid_pid = 8;
 static int col_wid_tty = 8;
 static int col_wid_uid = 10;
@@ -169,39 +488,182 @@ static int col_wid_ram = 10;
 static int col_wid_swap = 10;
 static int col_wid_cpu = 8;
 static int col_wid_age = 8;
-static int col_wid_rio = 10;
-static int col_wid_wio = 10;
-
-static bool show_col_ppid = true;
-static bool show_col_pgid = false;
-static bool show_col_sid = false;
-static bool show_col_pid = true;
-static bool show_col_tty = false;
-static bool show_col_uid = true;
-static bool show_col_ram = false;
-static bool show_col_swap = false;
-static bool show_col_cpu = false;
-static bool show_col_age = false;
-static bool show_col_rio = false;
-static bool show_col_wio = false;
-static bool show_col_cmd = true;
-
-static bool skipKernel = true;
-static bool skipThreads = true;
-static bool rssMem = false;
-static bool cpuTime = false;
-static bool totalIo = false;
-static bool noTree = false;
-static bool exeOnly = false;
-static bool noPid = false;
-static bool noName = false;
-static bool noHeader = false;
-static bool noTrunc = false;
-static bool artASCII = false;
-static bool verbose = false;
+static int col_wid_rio;
+static int col_wid_wio;
+static int col_wid_flt = 10;
+
+static bool show_col_ppid;
+static bool show_col_pgid;
+static bool show_col_sid;
+static bool show_col_pid;
+static bool show_col_tty;
+static bool show_col_uid;
+static bool show_col_ram;
+static bool show_col_swap;
+static bool show_col_cpu;
+static bool show_col_age;
+static bool show_col_rio;
+static bool show_col_wio;
+static bool show_col_flt;
+static bool show_col_cmd;
+
+static bool skipKernel;
+static bool skipThreads;
+static bool rssMem;
+static bool cpuTime;
+static bool totalIo;
+static bool cumulative;
+static bool noTree;
+static bool ancestors;
+static bool exeOnly;
+static bool noPid;
+static bool noName;
+static bool noHeader;
+static bool noTrunc;
+static bool artASCII;
+static bool verbose;
+
+static int jobs;
+static int intervalMs;
+static int watchMs;
+static int memRefreshMs;
+static bool procEvents;
+static bool useTaskstats;
+static bool timings;
+
+static const char *saveFile;
+static const char *loadFile;
+static const char *recordFile;
+static long long everyMs;
+static long long maxSize;
+static long long atMs; // unix time
+
+static bool daemonMode;
+static const char *socketPath;
+static long long refreshMs;
+static const char *connectPath;
+static bool rescan;
+
+static bool exporter;
+static const char *listenAddr;
+
+// --group: what --exporter aggregates to
+enum GroupKey
+{
+    GROUP_NONE,
+    GROUP_ROOT, // Each direct child of the root pids, with its subtree
+    GROUP_UID,
+    GROUP_CGROUP
+};
+
+static GroupKey groupKey;
+static bool noProcs;
+
+// --format
+enum OutFormat
+{
+    FORMAT_TEXT,
+    FORMAT_JSONL,
+    FORMAT_CSV,
+    FORMAT_TSV
+};
+
+static OutFormat outFormat;
+
+// --sort: pid, uid and cmd in ascending order, the rest descending.
+enum SortKey
+{
+    SORT_NONE,
+    SORT_PID,
+    SORT_UID,
+    SORT_RAM,
+    SORT_SWAP,
+    SORT_CPU,
+    SORT_AGE,
+    SORT_IO,
+    SORT_FLT,
+    SORT_CMD
+};
+
+static SortKey sortKey;
+static int topCount;
+
+// --match
+enum MatchMode
+{
+    MATCH_SUB,
+    MATCH_PREFIX,
+    MATCH_EXACT,
+    MATCH_REGEX
+};
+
+static MatchMode matchMode;
+
+// --mem: where RAM and SWAP are read from
+enum MemSource
+{
+    MEM_AUTO,
+    MEM_STATM,  // RSS only, a single line
+    MEM_ROLLUP, // smaps_rollup, or smaps on kernels without it
+    MEM_SMAPS
+};
+
+static MemSource memSource;
+
+static string procRoot;
+
+// A custom procfs root is expected to have sys/ as its sibling.
+static string sysDevChar = "/sys/dev/char";
+static string cgroupRoot = "/sys/fs/cgroup";
+
+// Rates are shown instead of totals (--interval or --watch).
+static bool sampled;
+
+// Read only stat and cmdline for all processes, and the rest for the printed ones.
+static bool lazyLoad = false;
 
 static bool hasMatchArgs;
 
+// Pid args are read from /proc/<pid>, without a scan of all of /proc.
+static bool directLookup;
+
+// Defaults of the options. Also restored by the daemon before each request.
+static void resetOpts()
+{
+    show_col_ppid = show_col_pid = show_col_uid = show_col_cmd = true;
+    show_col_pgid = show_col_sid = show_col_tty = show_col_ram = show_col_swap = show_col_cpu = show_col_age =
+        show_col_rio = show_col_wio = show_col_flt = false;
+
+    col_wid_rio = col_wid_wio = 10;
+
+    skipKernel = skipThreads = true;
+    rssMem = cpuTime = totalIo = cumulative = noTree = ancestors = exeOnly = noPid = noName = noHeader = noTrunc =
+        artASCII = verbose = directLookup = false;
+
+    jobs = intervalMs = watchMs = memRefreshMs = 0;
+    procEvents = useTaskstats = timings = false;
+
+    saveFile = loadFile = recordFile = nullptr;
+    everyMs = maxSize = 0;
+    atMs = -1;
+
+    daemonMode = rescan = false;
+    socketPath = connectPath = nullptr;
+    refreshMs = 0;
+
+    exporter = noProcs = false;
+    listenAddr = nullptr;
+    groupKey = GROUP_NONE;
+
+    outFormat = FORMAT_TEXT;
+    sortKey = SORT_NONE;
+    topCount = 0;
+    matchMode = MATCH_SUB;
+    memSource = MEM_AUTO;
+
+    procRoot = "/proc";
+}
+
 static int TERM_COLS;
 
 static string SMAPS_MATCH_RAM;
@@ -214,6 +676,173 @@ static string ART_DOWN_HORIZ;
 static string ART_HORIZ_LEFT;
 static string ART_VERT;
 
+// The cmd arguments, checked against each cmdline in a single pass: an
+// Aho-Corasick automaton for sub, prefix and exact matches, and a POSIX
+// extended regex per argument with --match regex.
+static vector<string> cmdPatterns;
+static vector<regex_t> cmdRegexes;
+
+// 256 transitions per state, completed with those of the failure state,
+// and the patterns ending at each state. State 0 is the root.
+static vector<int> acNext;
+static vector<vector<int>> acEnds;
+static size_t acMaxLen;
+
+static int compileMatcher(char **args, int count)
+{
+    for (regex_t &re : cmdRegexes)
+        regfree(&re);
+
+    cmdPatterns.clear();
+    cmdRegexes.clear();
+    acNext.assign(256, 0);
+    acEnds.assign(1, {});
+    acMaxLen = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (noPid || !isNumber(args[i], "pid", false))
+            cmdPatterns.push_back(args[i]);
+    }
+
+    if (matchMode == MATCH_REGEX)
+    {
+        for (string &pattern : cmdPatterns)
+        {
+            regex_t re;
+            int err = regcomp(&re, pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+
+            if (err)
+            {
+                char msg[256];
+                regerror(err, &re, msg, sizeof(msg));
+                return printErr("Bad regex " + pattern + ": " + msg);
+            }
+
+            cmdRegexes.push_back(re);
+        }
+
+        return 0;
+    }
+
+    for (size_t i = 0; i < cmdPatterns.size(); i++)
+    {
+        int state = 0;
+
+        for (unsigned char c : cmdPatterns[i])
+        {
+            if (!acNext[state * 256 + c])
+            {
+                acNext[state * 256 + c] = acEnds.size();
+                acEnds.emplace_back();
+                acNext.resize(acNext.size() + 256);
+            }
+
+            state = acNext[state * 256 + c];
+        }
+
+        acEnds[state].push_back(i);
+        acMaxLen = max(acMaxLen, cmdPatterns[i].length());
+    }
+
+    // Breadth-first, so that the failure state (the longest proper suffix
+    // in the trie) is already complete when its transitions are copied.
+    vector<int> fail(acEnds.size()), queue;
+
+    for (int c = 0; c < 256; c++)
+    {
+        if (acNext[c])
+            queue.push_back(acNext[c]);
+    }
+
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        int state = queue[i];
+        acEnds[state].insert(acEnds[state].end(), acEnds[fail[state]].begin(), acEnds[fail[state]].end());
+
+        for (int c = 0; c < 256; c++)
+        {
+            int &to = acNext[state * 256 + c];
+            int failTo = acNext[fail[state] * 256 + c];
+
+            if (to)
+            {
+                fail[to] = failTo;
+                queue.push_back(to);
+            }
+            else
+                to = failTo;
+        }
+    }
+
+    return 0;
+}
+
+// Sets the matched patterns in hits if given, or returns on the first match.
+static bool matchCmdline(IStr cmdline, vector<char> *hits = nullptr)
+{
+    // The match must end before the first space (if any) with exeOnly.
+    size_t len = exeOnly ? min(cmdline.view().find(' '), cmdline.length()) : cmdline.length();
+    bool matched = false;
+
+    if (matchMode == MATCH_REGEX)
+    {
+        string exe = len < cmdline.length() ? string(cmdline.view().substr(0, len)) : "";
+        const char *text = len < cmdline.length() ? exe.c_str() : cmdline.c_str();
+
+        for (size_t i = 0; i < cmdRegexes.size(); i++)
+        {
+            if (regexec(&cmdRegexes[i], text, 0, nullptr, 0))
+                continue;
+
+            if (!hits)
+                return true;
+
+            (*hits)[i] = true;
+            matched = true;
+        }
+
+        return matched;
+    }
+
+    auto found = [&](size_t end, int state) -> bool
+    {
+        for (int i : acEnds[state])
+        {
+            if (matchMode != MATCH_SUB && end != cmdPatterns[i].length())
+                continue;
+
+            if (matchMode == MATCH_EXACT && end != len)
+                continue;
+
+            if (!hits)
+                return true;
+
+            (*hits)[i] = true;
+            matched = true;
+        }
+
+        return false;
+    };
+
+    // Prefix and exact matches cannot end beyond the longest pattern.
+    size_t scanLen = matchMode == MATCH_SUB ? len : min(len, acMaxLen);
+    int state = 0;
+
+    if (found(0, state))
+        return true;
+
+    for (size_t i = 0; i < scanLen; i++)
+    {
+        state = acNext[state * 256 + (unsigned char)cmdline.c_str()[i]];
+
+        if (!acEnds[state].empty() && found(i + 1, state))
+            return true;
+    }
+
+    return matched;
+}
+
 static int parseProcOpts(char *procOpts)
 {
     if (procOpts == nullptr)
@@ -221,12 +850,14 @@ static int parseProcOpts(char *procOpts)
 
     show_col_ppid = show_col_pid = show_col_uid = show_col_cmd = false;
 
-    char *token = strtok(procOpts, ",");
+    // argv is left intact, to be sent with --connect.
+    string copy = procOpts;
+    char *token = strtok(copy.data(), ",");
     while (token)
     {
         if (!strcmp(token, "all"))
             show_col_ppid = show_col_pgid = show_col_sid = show_col_pid = show_col_tty = show_col_uid = show_col_ram =
-                show_col_swap = show_col_cpu = show_col_age = show_col_rio = show_col_wio = show_col_cmd = true;
+                show_col_swap = show_col_cpu = show_col_age = show_col_rio = show_col_wio = show_col_flt = show_col_cmd = true;
         else if (!strcmp(token, "ppid"))
             show_col_ppid = true;
         else if (!strcmp(token, "pgid"))
@@ -249,6 +880,8 @@ static int parseProcOpts(char *procOpts)
             show_col_age = true;
         else if (!strcmp(token, "io"))
             show_col_rio = show_col_wio = true;
+        else if (!strcmp(token, "flt"))
+            show_col_flt = true;
         else if (!strcmp(token, "cmd"))
             show_col_cmd = true;
         else
@@ -258,7 +891,8 @@ static int parseProcOpts(char *procOpts)
     }
 
     if (!show_col_ppid && !show_col_pgid && !show_col_sid && !show_col_pid && !show_col_tty && !show_col_uid &&
-        !show_col_ram && !show_col_swap && !show_col_cpu && !show_col_age && !show_col_rio && !show_col_wio && !show_col_cmd)
+        !show_col_ram && !show_col_swap && !show_col_cpu && !show_col_age && !show_col_rio && !show_col_wio && !show_col_flt &&
+        !show_col_cmd)
         return printErr("No column selected");
 
     return 0;
@@ -268,15 +902,48 @@ static int parseOpts(int argc, char **argv)
 {
     char *opts = nullptr;
 
+    // The default can be given explicitly too.
+    bool matchSet = false, memSet = false;
+
     enum
     {
         OPT_OPT = 'o',
+        OPT_JOBS = 'j',
         OPT_INC_KERNEL = '0',
         OPT_INC_THREADS = '1',
         OPT_RSS = '2',
+        OPT_MEM = 'P',
         OPT_CPU_TIME = '3',
         OPT_TOT_IO = '4',
+        OPT_CUMULATIVE = 'C',
+        OPT_INTERVAL = 'i',
+        OPT_WATCH = 'w',
+        OPT_MEM_REFRESH = 'm',
+        OPT_EVENTS = 'e',
+        OPT_TASKSTATS = 's',
+        OPT_PROC_ROOT = 'r',
+        OPT_TIMINGS = 'T',
+        OPT_SAVE = 'S',
+        OPT_LOAD = 'L',
+        OPT_RECORD = 'R',
+        OPT_EVERY = 'E',
+        OPT_MAX_SIZE = 'M',
+        OPT_AT = 'A',
+        OPT_DAEMON = 'D',
+        OPT_SOCKET = 'k',
+        OPT_REFRESH = 'f',
+        OPT_CONNECT = 'c',
+        OPT_RESCAN = 'n',
+        OPT_EXPORTER = 'X',
+        OPT_GROUP = 'G',
+        OPT_NO_PROCS = 'p',
+        OPT_LISTEN = 'l',
+        OPT_FORMAT = 'F',
+        OPT_SORT = 'O',
+        OPT_TOP = 'N',
         OPT_NO_TREE = '5',
+        OPT_ANCESTORS = 'y',
+        OPT_MATCH = 'x',
         OPT_NO_FULL = '6',
         OPT_NO_PID = '7',
         OPT_NO_NAME = '8',
@@ -291,12 +958,42 @@ static int parseOpts(int argc, char **argv)
     // https://www.gnu.org/software/libc/manual/html_node/Getopt-Long-Options.html
     // 'struct' qualifier is optional in C++
     const option longOpts[] = {{"opt", required_argument, nullptr, OPT_OPT},
+                               {"jobs", required_argument, nullptr, OPT_JOBS},
                                {"kernel", no_argument, nullptr, OPT_INC_KERNEL},
                                {"threads", no_argument, nullptr, OPT_INC_THREADS},
                                {"rss", no_argument, nullptr, OPT_RSS},
+                               {"mem", required_argument, nullptr, OPT_MEM},
                                {"cpu-time", no_argument, nullptr, OPT_CPU_TIME},
                                {"total-io", no_argument, nullptr, OPT_TOT_IO},
+                               {"cumulative", no_argument, nullptr, OPT_CUMULATIVE},
+                               {"interval", required_argument, nullptr, OPT_INTERVAL},
+                               {"watch", required_argument, nullptr, OPT_WATCH},
+                               {"mem-refresh", required_argument, nullptr, OPT_MEM_REFRESH},
+                               {"events", no_argument, nullptr, OPT_EVENTS},
+                               {"taskstats", no_argument, nullptr, OPT_TASKSTATS},
+                               {"proc-root", required_argument, nullptr, OPT_PROC_ROOT},
+                               {"timings", no_argument, nullptr, OPT_TIMINGS},
+                               {"save", required_argument, nullptr, OPT_SAVE},
+                               {"load", required_argument, nullptr, OPT_LOAD},
+                               {"record", required_argument, nullptr, OPT_RECORD},
+                               {"every", required_argument, nullptr, OPT_EVERY},
+                               {"max-size", required_argument, nullptr, OPT_MAX_SIZE},
+                               {"at", required_argument, nullptr, OPT_AT},
+                               {"daemon", no_argument, nullptr, OPT_DAEMON},
+                               {"socket", required_argument, nullptr, OPT_SOCKET},
+                               {"refresh", required_argument, nullptr, OPT_REFRESH},
+                               {"connect", required_argument, nullptr, OPT_CONNECT},
+                               {"rescan", no_argument, nullptr, OPT_RESCAN},
+                               {"exporter", no_argument, nullptr, OPT_EXPORTER},
+                               {"group", required_argument, nullptr, OPT_GROUP},
+                               {"no-procs", no_argument, nullptr, OPT_NO_PROCS},
+                               {"listen", required_argument, nullptr, OPT_LISTEN},
+                               {"format", required_argument, nullptr, OPT_FORMAT},
+                               {"sort", required_argument, nullptr, OPT_SORT},
+                               {"top", required_argument, nullptr, OPT_TOP},
                                {"no-tree", no_argument, nullptr, OPT_NO_TREE},
+                               {"ancestors", no_argument, nullptr, OPT_ANCESTORS},
+                               {"match", required_argument, nullptr, OPT_MATCH},
                                {"no-full", no_argument, nullptr, OPT_NO_FULL},
                                {"no-pid", no_argument, nullptr, OPT_NO_PID},
                                {"no-name", no_argument, nullptr, OPT_NO_NAME},
@@ -310,7 +1007,7 @@ static int parseOpts(int argc, char **argv)
 
     int opt;
 
-    while ((opt = getopt_long(argc, argv, "o:vVh", longOpts, nullptr)) != -1)
+    while ((opt = getopt_long(argc, argv, "o:j:vVh", longOpts, nullptr)) != -1)
     {
         switch (opt)
         {
@@ -319,6 +1016,12 @@ static int parseOpts(int argc, char **argv)
                 return dupError("opt");
             opts = optarg;
             break;
+        case OPT_JOBS:
+            if (jobs)
+                return dupError("jobs");
+            if (!isNumber(optarg, "jobs", true) || (jobs = stoi(optarg)) <= 0)
+                return printErr("Bad argument with --jobs: " + (string)optarg);
+            break;
         case OPT_INC_KERNEL:
             skipKernel = false;
             break;
@@ -328,15 +1031,198 @@ static int parseOpts(int argc, char **argv)
         case OPT_RSS:
             rssMem = true;
             break;
+        case OPT_MEM:
+            if (memSet)
+                return dupError("mem");
+            memSet = true;
+            if (!strcmp(optarg, "statm"))
+                memSource = MEM_STATM;
+            else if (!strcmp(optarg, "rollup"))
+                memSource = MEM_ROLLUP;
+            else if (!strcmp(optarg, "smaps"))
+                memSource = MEM_SMAPS;
+            else if (strcmp(optarg, "auto"))
+                return printErr("Bad argument with --mem: " + (string)optarg);
+            break;
         case OPT_CPU_TIME:
             cpuTime = true;
             break;
         case OPT_TOT_IO:
             totalIo = true;
             break;
+        case OPT_CUMULATIVE:
+            cumulative = true;
+            break;
+        case OPT_INTERVAL:
+            if (intervalMs)
+                return dupError("interval");
+            if (!isNumber(optarg, "interval", true) || (intervalMs = stoi(optarg)) <= 0)
+                return printErr("Bad argument with --interval: " + (string)optarg);
+            break;
+        case OPT_WATCH:
+            if (watchMs)
+                return dupError("watch");
+            if (!isNumber(optarg, "watch", true) || (watchMs = stoi(optarg)) <= 0)
+                return printErr("Bad argument with --watch: " + (string)optarg);
+            break;
+        case OPT_MEM_REFRESH:
+            if (memRefreshMs)
+                return dupError("mem-refresh");
+            if (!isNumber(optarg, "mem-refresh", true) || (memRefreshMs = stoi(optarg)) <= 0)
+                return printErr("Bad argument with --mem-refresh: " + (string)optarg);
+            break;
+        case OPT_EVENTS:
+            procEvents = true;
+            break;
+        case OPT_TASKSTATS:
+            useTaskstats = true;
+            break;
+        case OPT_PROC_ROOT:
+            if (procRoot != "/proc")
+                return dupError("proc-root");
+            procRoot = optarg;
+            while (procRoot.length() > 1 && procRoot.back() == '/')
+                procRoot.pop_back();
+            if (procRoot.empty())
+                return printErr("Bad argument with --proc-root: " + (string)optarg);
+            break;
+        case OPT_TIMINGS:
+            timings = true;
+            break;
+        case OPT_SAVE:
+            if (saveFile)
+                return dupError("save");
+            saveFile = optarg;
+            break;
+        case OPT_LOAD:
+            if (loadFile)
+                return dupError("load");
+            loadFile = optarg;
+            break;
+        case OPT_RECORD:
+            if (recordFile)
+                return dupError("record");
+            recordFile = optarg;
+            break;
+        case OPT_EVERY:
+            if (everyMs)
+                return dupError("every");
+            if ((everyMs = parseDuration(optarg)) <= 0)
+                return printErr("Bad argument with --every: " + (string)optarg);
+            break;
+        case OPT_MAX_SIZE:
+            if (maxSize)
+                return dupError("max-size");
+            if ((maxSize = parseSize(optarg)) <= 0)
+                return printErr("Bad argument with --max-size: " + (string)optarg);
+            break;
+        case OPT_AT:
+            if (atMs >= 0)
+                return dupError("at");
+            if ((atMs = parseTime(optarg)) < 0)
+                return printErr("Bad argument with --at: " + (string)optarg);
+            break;
+        case OPT_DAEMON:
+            daemonMode = true;
+            break;
+        case OPT_SOCKET:
+            if (socketPath)
+                return dupError("socket");
+            socketPath = optarg;
+            break;
+        case OPT_REFRESH:
+            if (refreshMs)
+                return dupError("refresh");
+            if ((refreshMs = parseDuration(optarg)) <= 0)
+                return printErr("Bad argument with --refresh: " + (string)optarg);
+            break;
+        case OPT_CONNECT:
+            if (connectPath)
+                return dupError("connect");
+            connectPath = optarg;
+            break;
+        case OPT_RESCAN:
+            rescan = true;
+            break;
+        case OPT_EXPORTER:
+            exporter = true;
+            break;
+        case OPT_GROUP:
+            if (groupKey != GROUP_NONE)
+                return dupError("group");
+            if (!strcmp(optarg, "root"))
+                groupKey = GROUP_ROOT;
+            else if (!strcmp(optarg, "uid"))
+                groupKey = GROUP_UID;
+            else if (!strcmp(optarg, "cgroup"))
+                groupKey = GROUP_CGROUP;
+            else
+                return printErr("Bad argument with --group: " + (string)optarg);
+            break;
+        case OPT_NO_PROCS:
+            noProcs = true;
+            break;
+        case OPT_LISTEN:
+            if (listenAddr)
+                return dupError("listen");
+            listenAddr = optarg;
+            break;
+        case OPT_FORMAT:
+            if (outFormat != FORMAT_TEXT)
+                return dupError("format");
+            if (!strcmp(optarg, "jsonl"))
+                outFormat = FORMAT_JSONL;
+            else if (!strcmp(optarg, "csv"))
+                outFormat = FORMAT_CSV;
+            else if (!strcmp(optarg, "tsv"))
+                outFormat = FORMAT_TSV;
+            else
+                return printErr("Bad argument with --format: " + (string)optarg);
+            break;
+        case OPT_MATCH:
+            if (matchSet)
+                return dupError("match");
+            matchSet = true;
+            if (!strcmp(optarg, "sub"))
+                matchMode = MATCH_SUB;
+            else if (!strcmp(optarg, "prefix"))
+                matchMode = MATCH_PREFIX;
+            else if (!strcmp(optarg, "exact"))
+                matchMode = MATCH_EXACT;
+            else if (!strcmp(optarg, "regex"))
+                matchMode = MATCH_REGEX;
+            else
+                return printErr("Bad argument with --match: " + (string)optarg);
+            break;
+        case OPT_SORT:
+        {
+            if (sortKey != SORT_NONE)
+                return dupError("sort");
+
+            const pair<const char *, SortKey> keys[] = {{"pid", SORT_PID}, {"uid", SORT_UID}, {"ram", SORT_RAM}, {"swap", SORT_SWAP}, {"cpu", SORT_CPU}, {"age", SORT_AGE}, {"io", SORT_IO}, {"flt", SORT_FLT}, {"cmd", SORT_CMD}};
+
+            for (auto &key : keys)
+            {
+                if (!strcmp(optarg, key.first))
+                    sortKey = key.second;
+            }
+
+            if (sortKey == SORT_NONE)
+                return printErr("Bad argument with --sort: " + (string)optarg);
+            break;
+        }
+        case OPT_TOP:
+            if (topCount)
+                return dupError("top");
+            if (!isNumber(optarg, "top", true) || (topCount = stoi(optarg)) <= 0)
+                return printErr("Bad argument with --top: " + (string)optarg);
+            break;
         case OPT_NO_TREE:
             noTree = true;
             break;
+        case OPT_ANCESTORS:
+            ancestors = true;
+            break;
         case OPT_NO_FULL:
             exeOnly = true;
             break;
@@ -371,30 +1257,188 @@ static int parseOpts(int argc, char **argv)
 
     hasMatchArgs = argc != optind;
 
-    if (noTree && !hasMatchArgs)
-        return printErr("--no-tree requires pid or cmd argument to match");
+    if (noTree && !hasMatchArgs && !topCount)
+        return printErr("--no-tree requires pid or cmd argument to match, or --top");
+
+    if (ancestors && !hasMatchArgs)
+        return printErr("--ancestors requires pid or cmd argument to match");
+
+    if (ancestors && (noTree || topCount || cumulative || exporter || groupKey != GROUP_NONE))
+        return printErr("--ancestors cannot be used with --no-tree, --top, --cumulative, --exporter or --group");
 
     if (exeOnly && !hasMatchArgs)
         return printErr("--no-full requires pid or cmd argument to match");
 
+    if (matchSet && !hasMatchArgs)
+        return printErr("--match requires pid or cmd argument to match");
+
     if (noPid && !hasMatchArgs)
         return printErr("--no-pid requires pid or cmd argument to match");
 
     if (parseProcOpts(opts))
         return 1;
 
-    if (rssMem && !show_col_ram && !show_col_swap)
-        return printErr("--rss requires 'ram' or 'swap' column");
+    if (compileMatcher(argv + optind, argc - optind))
+        return 1;
 
-    if (cpuTime && !show_col_cpu)
-        return printErr("--cpu-time requires 'cpu' column");
+    if (saveFile && loadFile)
+        return printErr("--save cannot be used with --load");
+
+    if (saveFile && (hasMatchArgs || opts || intervalMs || watchMs))
+        return printErr("--save cannot be used with -o, --interval, --watch or args");
+
+    if (loadFile && (intervalMs || watchMs || useTaskstats || procRoot != "/proc"))
+        return printErr("--load cannot be used with --interval, --watch, --taskstats or --proc-root");
+
+    if (recordFile && (saveFile || loadFile))
+        return printErr("--record cannot be used with --save or --load");
+
+    if (recordFile && (hasMatchArgs || opts || intervalMs || watchMs || procEvents || !skipThreads))
+        return printErr("--record cannot be used with -o, --interval, --watch, --events, --threads or args");
+
+    if ((everyMs || maxSize) && !recordFile)
+        return printErr(everyMs ? "--every requires --record" : "--max-size requires --record");
+
+    if (atMs >= 0 && !loadFile)
+        return printErr("--at requires --load");
+
+    if (daemonMode != !!socketPath)
+        return printErr(daemonMode ? "--daemon requires --socket" : "--socket requires --daemon");
+
+    if (daemonMode && (hasMatchArgs || intervalMs || watchMs || procEvents || saveFile || loadFile || recordFile || connectPath))
+        return printErr("--daemon cannot be used with --interval, --watch, --events, --save, --load, --record, --connect or args");
+
+    if (refreshMs && !daemonMode && !listenAddr)
+        return printErr("--refresh requires --daemon or --listen");
+
+    if (connectPath && (intervalMs || watchMs || procEvents || saveFile || loadFile || recordFile))
+        return printErr("--connect cannot be used with --interval, --watch, --events, --save, --load or --record");
+
+    if (rescan && !connectPath)
+        return printErr("--rescan requires --connect");
+
+    if (exporter && (intervalMs || watchMs || saveFile || recordFile || outFormat != FORMAT_TEXT || sortKey != SORT_NONE ||
+                     cumulative || !skipThreads || daemonMode || connectPath))
+        return printErr("--exporter cannot be used with --interval, --watch, --save, --record, --format, --sort, --cumulative, --threads, --daemon or --connect");
+
+    // The args are the roots to group by.
+    for (int i = optind; i < argc && exporter; i++)
+    {
+        if (!isNumber(argv[i], "pid", true))
+            return 1;
+    }
+
+    if ((groupKey == GROUP_ROOT || groupKey == GROUP_UID) && !exporter)
+        return printErr("--group root and --group uid require --exporter");
+
+    if (exporter && (groupKey == GROUP_UID || groupKey == GROUP_CGROUP) && hasMatchArgs)
+        return printErr("--group uid and --group cgroup cannot be used with --exporter and args");
+
+    if (groupKey == GROUP_CGROUP && (intervalMs || watchMs || !skipThreads || cumulative || topCount || outFormat != FORMAT_TEXT ||
+                                     saveFile || loadFile || recordFile || daemonMode || connectPath))
+        return printErr("--group cgroup cannot be used with --interval, --watch, --threads, --cumulative, --top, --format, --save, --load, --record, --daemon or --connect");
+
+    if (noProcs && groupKey != GROUP_CGROUP)
+        return printErr("--no-procs requires --group cgroup");
+
+    // The metrics are read from the cgroup files.
+    if (exporter && groupKey == GROUP_CGROUP)
+        noProcs = true;
+
+    if (listenAddr && !exporter)
+        return printErr("--listen requires --exporter");
+
+    if (listenAddr && loadFile)
+        return printErr("--listen cannot be used with --load");
+
+    if (exporter && groupKey == GROUP_NONE)
+        groupKey = GROUP_ROOT;
+
+    // The metrics follow the columns, all of them by default. The labels need uid or cmd.
+    if (exporter && !opts)
+        show_col_ram = show_col_swap = show_col_cpu = show_col_rio = show_col_wio = true;
+
+    if (groupKey == GROUP_UID)
+        show_col_uid = true;
+
+    if (groupKey == GROUP_ROOT)
+        show_col_cmd = true;
+
+    // All the columns are saved (or kept), so that any of them can be loaded.
+    if (saveFile || recordFile || (daemonMode && !opts))
+        show_col_pgid = show_col_sid = show_col_tty = show_col_ram = show_col_swap = show_col_cpu = show_col_age =
+            show_col_rio = show_col_wio = show_col_flt = true;
+
+    if (rssMem && !show_col_ram && !show_col_swap)
+        return printErr("--rss requires 'ram' or 'swap' column");
+
+    if (memSet && !show_col_ram && !show_col_swap)
+        return printErr("--mem requires 'ram' or 'swap' column");
+
+    if (memSource == MEM_STATM && show_col_swap)
+        return printErr("--mem statm cannot be used with 'swap' column");
+
+    if (cpuTime && !show_col_cpu)
+        return printErr("--cpu-time requires 'cpu' column");
 
     if (totalIo && !show_col_rio && !show_col_wio)
         return printErr("--total-io requires 'io' column");
 
+    if (cumulative && !show_col_ram && !show_col_swap && !show_col_cpu && !show_col_rio && !show_col_wio)
+        return printErr("--cumulative requires 'ram', 'swap', 'cpu' or 'io' column");
+
+    if (intervalMs && !show_col_cpu && !show_col_rio && !show_col_wio && !show_col_flt)
+        return printErr("--interval requires 'cpu', 'io' or 'flt' column");
+
+    if (intervalMs && watchMs)
+        return printErr("--interval cannot be used with --watch");
+
+    if (memRefreshMs && !watchMs && !daemonMode && !listenAddr)
+        return printErr("--mem-refresh requires --watch, --daemon or --listen");
+
+    if (memRefreshMs && !show_col_ram && !show_col_swap)
+        return printErr("--mem-refresh requires 'ram' or 'swap' column");
+
+    if (procEvents && !watchMs)
+        return printErr("--events requires --watch");
+
+    if (useTaskstats && !show_col_rio && !show_col_wio)
+        return printErr("--taskstats requires 'io' column");
+
+    if (useTaskstats && totalIo)
+        return printErr("--taskstats cannot be used with --total-io");
+
     if (noName && !show_col_uid)
         return printErr("--no-name requires 'uid' column");
 
+    // Netlink reports the pids of the running kernel.
+    if (procRoot != "/proc" && (procEvents || useTaskstats))
+        return printErr("--proc-root cannot be used with --events or --taskstats");
+
+    if (topCount && sortKey == SORT_NONE)
+        return printErr("--top requires --sort");
+
+    // The sorted column is shown, so that its value is read.
+    const pair<SortKey, bool> sortCols[] = {{SORT_UID, show_col_uid}, {SORT_RAM, show_col_ram}, {SORT_SWAP, show_col_swap}, {SORT_CPU, show_col_cpu}, {SORT_AGE, show_col_age}, {SORT_IO, show_col_rio || show_col_wio}, {SORT_FLT, show_col_flt}, {SORT_CMD, show_col_cmd}};
+
+    for (auto &col : sortCols)
+    {
+        if (sortKey == col.first && !col.second)
+            return printErr("--sort requires the sorted column");
+    }
+
+    if (outFormat != FORMAT_TEXT && watchMs)
+        return printErr("--format cannot be used with --watch");
+
+    if (timings && (watchMs || recordFile || daemonMode))
+        return printErr("--timings cannot be used with --watch, --record or --daemon");
+
+    // Only the given pids (and their parents) are needed: no child trees,
+    // no cmd to match and no later sample of all of /proc.
+    directLookup = (noTree || ancestors) && !topCount && !noPid && !cumulative && !intervalMs && !watchMs && !loadFile &&
+                   !daemonMode && !exporter && groupKey == GROUP_NONE && all_of(argv + optind, argv + argc, [](char *arg)
+                                                      { return isNumber(arg, "pid", false); });
+
     return 0;
 }
 
@@ -406,6 +1450,42 @@ static void initVars()
     if (!artASCII && !isatty(STDOUT_FILENO))
         artASCII = true;
 
+    sampled = intervalMs || watchMs;
+
+    if (watchMs && !memRefreshMs)
+        memRefreshMs = max(watchMs, 10000);
+
+    if (recordFile && !everyMs)
+        everyMs = 5000;
+
+    if ((daemonMode || listenAddr) && !refreshMs)
+        refreshMs = 2000;
+
+    if ((daemonMode || listenAddr) && !memRefreshMs)
+        memRefreshMs = max(refreshMs, 10000LL);
+
+    // Rates are suffixed with "/s".
+    if (sampled)
+        col_wid_rio = col_wid_wio = 12;
+
+    if (procRoot != "/proc")
+    {
+        sysDevChar = procRoot + "/../sys/dev/char";
+        cgroupRoot = procRoot + "/../sys/fs/cgroup";
+    }
+
+    // cgroup v2 is mounted on unified/ in the hybrid layout.
+    if (groupKey == GROUP_CGROUP && access((cgroupRoot + "/cgroup.controllers").c_str(), F_OK) &&
+        !access((cgroupRoot + "/unified/cgroup.controllers").c_str(), F_OK))
+        cgroupRoot += "/unified";
+
+    // statm is the cheapest, but has neither PSS nor SWAP.
+    if (memSource == MEM_AUTO)
+        memSource = rssMem && !show_col_swap ? MEM_STATM : MEM_ROLLUP;
+
+    if (memSource == MEM_STATM)
+        rssMem = true;
+
     SMAPS_MATCH_RAM = rssMem ? "Rss:" : "Pss:";
     SMAPS_MATCH_SWAP = rssMem ? "Swap:" : "SwapPss:";
 
@@ -419,101 +1499,355 @@ static void initVars()
 
 /////////////////////////////////////////////////////////////////////////
 
+// Opened once, all per-pid directories are opened relative to it.
+static int procFd = -1;
+
+// glibc exposes getdents64() only since 2.30, and bionic not at all.
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
 // https://github.com/htop-dev/htop/blob/3.0.5/linux/LinuxProcessList.c#L1252
 // https://android.googlesource.com/platform/frameworks/base/+/refs/tags/android-11.0.0_r1/core/jni/android_util_Process.cpp#708
-static int parseProcTree(string path, auto cb, bool printErr = true)
+static int parseProcTree(int dirFd, auto cb)
 {
-    DIR *dir = opendir(path.c_str());
-
-    if (!dir)
-        return printErr ? printErrCode("Failed to read " + path) : 1;
+    // Many entries per syscall instead of one readdir() buffer refill per 32 KB.
+    char buf[1 << 16];
 
-    const struct dirent *entry;
+    if (lseek(dirFd, 0, SEEK_SET) < 0)
+        return 1;
 
-    int err = 0;
+    long len;
 
-    while ((entry = readdir(dir)))
+    while ((len = syscall(SYS_getdents64, dirFd, buf, sizeof(buf))) > 0)
     {
-        // Ignore non-directories
-        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
-            continue;
+        for (long off = 0; off < len;)
+        {
+            const struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + off);
+            off += entry->d_reclen;
 
-        const char *name = entry->d_name;
+            // Ignore non-directories
+            if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+                continue;
 
-        // Skip non-number directories
-        if (name[0] < '0' || name[0] > '9')
-            continue;
+            // Skip non-number directories
+            pid_t pid = 0;
+            const char *name = entry->d_name;
 
-        pid_t pid = stoi(name);
+            for (; *name >= '0' && *name <= '9'; name++)
+                pid = 10 * pid + *name - '0';
 
-        if (pid > 0 && !cb(pid))
-        {
-            err = 1;
-            break;
+            if (*name || pid <= 0)
+                continue;
+
+            if (!cb(pid))
+                return 1;
         }
     }
 
-    closedir(dir);
+    return len < 0;
+}
+
+static int parseProcTree(string path, auto cb, bool printErr = true)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+        return printErr ? printErrCode("Failed to read " + path) : 1;
+
+    int err = parseProcTree(fd, cb);
+
+    close(fd);
     return err;
 }
 
+static set<pid_t> skippedKernelProc;
+
+// Worker threads of the /proc scan collect into their own buffers, which
+// are merged into the global maps in /proc order once all workers finish.
+struct ScanBuffer
+{
+    list<pair<size_t, Proc>> procs; // Index in the pid list
+    map<pid_t, string> errMap;
+    set<pid_t> skippedKernelProc;
+};
+
+static thread_local ScanBuffer *scanBuf = nullptr;
+
+static string procPath(Proc &proc, const char *file = nullptr)
+{
+    string path = procRoot + "/" + to_string(proc.pid) + (proc.tid ? "/task/" + to_string(proc.tid) : "");
+    return file ? path + "/" + file : path;
+}
+
+// ENOENT or ESRCH: the process died, or its pid has already been reused
+// and the directory handle no longer refers to a live process.
 static int handleProcReadError(string path, Proc &proc)
 {
-    if (errno != ENOENT)
+    if (errno != ENOENT && errno != ESRCH)
     {
         if (verbose)
             printErrCode("Failed to read " + path);
         else if (!proc.tid)
-            errMap.insert({proc.pid, "Failed to read " + path + ": " + strerror(errno)});
+            (scanBuf ? scanBuf->errMap : errMap).insert({proc.pid, "Failed to read " + path + ": " + strerror(errno)});
     }
 
     proc.failed = true;
     return 1;
 }
 
-static int getLines(string path, Proc &proc, auto cb)
+struct KeyVal
 {
-    errno = 0;
+    const char *key; // Including the trailing ':'
+    int skip = 0;    // Number of values to skip after the key
+    long long val = 0;
+    bool found = false;
+};
 
-    ifstream file;
-    file.open(path);
+static bool scanNumber(const char *&ptr, const char *end, long long &num)
+{
+    while (ptr < end && (*ptr == ' ' || *ptr == '\t'))
+        ptr++;
 
-    try
-    {
-        if (!file.good())
-            return handleProcReadError(path, proc);
-    }
-    catch (const std::ios::failure &)
+    if (ptr == end || *ptr < '0' || *ptr > '9')
+        return false;
+
+    for (num = 0; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++)
+        num = 10 * num + *ptr - '0';
+
+    return true;
+}
+
+// Parses "Key: value ..." lines from fd (which is closed) through a fixed
+// buffer. Stops as soon as all keys are found, unless the values of the
+// repeating keys are to be summed up (e.g. in smaps). Small procfs files
+// like status and io are consumed in a single read().
+static int scanKeyVals(int fd, Proc &proc, const char *file, KeyVal *kvs, int count, bool sum = false)
+{
+    if (fd < 0)
+        return handleProcReadError(procPath(proc, file), proc);
+
+    size_t keyLens[count];
+    for (int i = 0; i < count; i++)
+        keyLens[i] = strlen(kvs[i].key);
+
+    int left = count;
+
+    auto cb = [&](const char *line, const char *end) -> bool
     {
-        return handleProcReadError(path, proc);
-    }
+        for (int i = 0; i < count; i++)
+        {
+            KeyVal &kv = kvs[i];
+
+            if ((!sum && kv.found) || (size_t)(end - line) < keyLens[i] || memcmp(line, kv.key, keyLens[i]))
+                continue;
+
+            const char *ptr = line + keyLens[i];
+            long long num = 0;
+
+            for (int j = 0; j <= kv.skip; j++)
+            {
+                if (!scanNumber(ptr, end, num))
+                    return true;
+            }
+
+            kv.val = sum ? kv.val + num : num;
+            kv.found = true;
+
+            return sum || --left;
+        }
+
+        return true;
+    };
 
-    string line, field;
+    char buf[4096];
+    size_t len = 0;
+    ssize_t res;
+    bool done = false, skip = false;
 
-    while (getline(file, line))
+    while (!done && (res = read(fd, buf + len, sizeof(buf) - len)) > 0)
     {
-        if (!cb(line))
-            break;
+        len += res;
+
+        char *line = buf, *end = buf + len, *nl;
+
+        // Skip the rest of a dropped line.
+        if (skip)
+        {
+            if (!(nl = (char *)memchr(line, '\n', len)))
+            {
+                len = 0;
+                continue;
+            }
+
+            line = nl + 1;
+            skip = false;
+        }
+
+        while (!done && (nl = (char *)memchr(line, '\n', end - line)))
+        {
+            done = !cb(line, nl);
+            line = nl + 1;
+        }
+
+        len = end - line;
+
+        // Drop a line that does not fit in the buffer.
+        if (len == sizeof(buf))
+        {
+            len = 0;
+            skip = true;
+        }
+        else if (len)
+            memmove(buf, line, len);
     }
 
-    file.close();
+    if (!done && len && res == 0)
+        cb(buf, buf + len);
+
+    // Like ifstream, ignore read errors (e.g. EACCES on io) after a successful open().
+    close(fd);
     return 0;
 }
 
+static int scanKeyValsAt(int dirFd, Proc &proc, const char *file, KeyVal *kvs, int count)
+{
+    errno = 0;
+    return scanKeyVals(openat(dirFd, file, O_RDONLY | O_CLOEXEC), proc, file, kvs, count);
+}
+
 // For uptime
 static struct sysinfo sInfo;
 
+static long long monotonicNs()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// --timings: time spent in reading procfs, building the tree, and printing.
+static long long scanNs = 0, treeNs = 0, renderNs = 0;
+
 // For cpu time and start time
 static int SC_CLK_TCK;
 
-static void parseStat(Proc &proc)
+// /proc/tty/drivers: the device path and minor range of each tty driver.
+struct TtyDriver
+{
+    string path;
+    int maj, minFirst, minLast;
+};
+
+static vector<TtyDriver> ttyDrivers;
+static bool ttyDriversRead = false;
+
+// Resolved once per device, and kept across the refreshes in watch mode.
+static map<pair<int, int>, IStr> ttyNames;
+static mutex ttyNamesLock;
+
+static void readTtyDrivers()
+{
+    ttyDriversRead = true;
+
+    FILE *file = fopen((procRoot + "/tty/drivers").c_str(), "r");
+    if (!file)
+        return;
+
+    char line[256], path[128];
+    TtyDriver driver;
+
+    // e.g. "serial  /dev/ttyS  4 64-111 serial"
+    while (fgets(line, sizeof(line), file))
+    {
+        int count = sscanf(line, "%*s %127s %d %d-%d", path, &driver.maj, &driver.minFirst, &driver.minLast);
+
+        if (count < 3 || strncmp(path, "/dev/", 5))
+            continue;
+
+        if (count == 3)
+            driver.minLast = -1;
+
+        driver.path = path + 5;
+        ttyDrivers.push_back(driver);
+    }
+
+    fclose(file);
+}
+
+static string readTtyName(int maj, int min)
+{
+    // DEVNAME from the uevent of the device.
+    string path = sysDevChar + "/" + to_string(maj) + ":" + to_string(min);
+    int dirFd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    string uevent;
+
+    if (dirFd >= 0)
+    {
+        int fd = openat(dirFd, "uevent", O_RDONLY | O_CLOEXEC);
+        close(dirFd);
+
+        char buf[256];
+        ssize_t count;
+
+        if (fd >= 0 && (count = read(fd, buf, sizeof(buf) - 1)) > 0)
+            uevent.assign(buf, count);
+
+        if (fd >= 0)
+            close(fd);
+    }
+
+    size_t pos = uevent.find("DEVNAME=");
+
+    if (pos != string::npos)
+    {
+        size_t end = uevent.find('\n', pos);
+        if (end != string::npos)
+            return uevent.substr(pos + 8, end - pos - 8);
+    }
+
+    if (!ttyDriversRead)
+        readTtyDrivers();
+
+    // https://gitlab.com/procps-ng/procps/-/blob/v4.0.1/library/devname.c#L160
+    for (TtyDriver &driver : ttyDrivers)
+    {
+        if (driver.maj != maj)
+            continue;
+
+        if (driver.minLast < 0 && driver.minFirst == min)
+            return driver.path;
+
+        if (min >= driver.minFirst && min <= driver.minLast)
+            return driver.path + to_string(min - driver.minFirst);
+    }
+
+    return to_string(maj) + "." + to_string(min);
+}
+
+static IStr getTtyName(int maj, int min)
+{
+    lock_guard<mutex> lock(ttyNamesLock);
+
+    auto it = ttyNames.find({maj, min});
+
+    if (it == ttyNames.end())
+        it = ttyNames.insert({{maj, min}, readTtyName(maj, min)}).first;
+
+    return it->second;
+}
+
+// When sampling, the fields which do not change over time are not re-read.
+static void parseStat(Proc &proc, int dirFd, bool sample = false)
 {
-    string path = "/proc/" + to_string(proc.pid) + (proc.tid ? "/task/" + to_string(proc.tid) : "") + "/stat";
-    int fd = open(path.c_str(), O_RDONLY);
+    int fd = openat(dirFd, "stat", O_RDONLY | O_CLOEXEC);
 
     if (fd < 0)
     {
-        handleProcReadError(path, proc);
+        handleProcReadError(procPath(proc, "stat"), proc);
         return;
     }
 
@@ -522,12 +1856,18 @@ static void parseStat(Proc &proc)
     int len = read(fd, buf, sizeof(buf) - 1);
     close(fd);
 
-    if (len < 0)
+    if (len <= 0)
     {
-        handleProcReadError(path, proc);
+        // An empty stat: the process exited after it was listed.
+        if (len == 0)
+            errno = ENOENT;
+
+        handleProcReadError(procPath(proc, "stat"), proc);
         return;
     }
 
+    proc.sampleTime = monotonicNs();
+
     buf[len] = '\0'; // Ignore buffer contents beyond this position
 
     // Jump to the end of 2nd field (comm)
@@ -559,7 +1899,7 @@ static void parseStat(Proc &proc)
     del = strchr(del, ' ');
     del++;
 
-    if (show_col_tty)
+    if (show_col_tty && !sample)
     {
         int dev = stoi(del);
         if (dev != 0)
@@ -573,42 +1913,36 @@ static void parseStat(Proc &proc)
             else if (maj == 136)
                 proc.tty = "pts/" + to_string(min);
             else
-            {
-                // May also read from /proc/devices
-                FILE *file = fopen(("/sys/dev/char/" + to_string(maj) + ":" + to_string(min) + "/uevent").c_str(), "r");
-                char buf1[256];
-
-                int count;
-                bool found = false;
-
-                if (file && (count = fread(buf1, 1, sizeof(buf1) - 1, file)) > 0)
-                {
-                    buf1[count] = '\0';
-
-                    char *ptr = strstr(buf1, "DEVNAME=");
-                    if (ptr)
-                    {
-                        char *buf2 = ptr + 8;
-                        ptr = strchr(buf2, '\n');
-                        if (ptr)
-                        {
-                            *ptr = '\0';
-                            proc.tty = buf2;
-                            found = true;
-                        }
-                    }
-                }
-                if (!found)
-                    proc.tty = to_string(maj) + "." + to_string(min);
-            }
+                proc.tty = getTtyName(maj, min);
         }
     }
 
-    if (!show_col_age && !show_col_cpu)
+    // Start time is required to detect a reused pid when sampling or loading lazily.
+    if (!show_col_age && !show_col_cpu && !show_col_flt && !sampled && !lazyLoad)
         return;
 
+    // 10th field (minflt)
+    for (int i = 1; i <= 3; i++)
+    {
+        del = strchr(del, ' ');
+        del++;
+    }
+
+    if (show_col_flt)
+        proc.minFlt = strtol(del, nullptr, 10);
+
+    // 12th field (majflt)
+    for (int i = 1; i <= 2; i++)
+    {
+        del = strchr(del, ' ');
+        del++;
+    }
+
+    if (show_col_flt)
+        proc.majFlt = strtol(del, nullptr, 10);
+
     // 14th field (utime)
-    for (int i = 1; i <= 7; i++)
+    for (int i = 1; i <= 2; i++)
     {
         del = strchr(del, ' ');
         del++;
@@ -617,14 +1951,14 @@ static void parseStat(Proc &proc)
     long utime = 0;
 
     if (show_col_cpu)
-        utime = stoll(del);
+        utime = strtoll(del, nullptr, 10);
 
     // 15th field (stime)
     del = strchr(del, ' ');
     del++;
 
     if (show_col_cpu)
-        proc.cpuTime = 1000 * (utime + stoll(del)) / SC_CLK_TCK;
+        proc.cpuTime = 1000 * (utime + strtoll(del, nullptr, 10)) / SC_CLK_TCK;
 
     // 22nd field (starttime)
     for (int i = 1; i <= 7; i++)
@@ -633,37 +1967,22 @@ static void parseStat(Proc &proc)
         del++;
     }
 
-    if (sysinfo(&sInfo))
-    {
-        printErrCode("Failed to get sysinfo");
-        proc.failed = true;
-    }
-    else
-        proc.age = 1000 * sInfo.uptime - 1000 * stoll(del) / SC_CLK_TCK;
+    proc.startTime = strtoll(del, nullptr, 10);
+
+    if (!sample)
+        proc.age = 1000 * sInfo.uptime - 1000 * proc.startTime / SC_CLK_TCK;
 }
 
-static void parseStatus(Proc &proc)
+static void parseStatus(Proc &proc, int dirFd)
 {
     if (proc.failed || !show_col_uid)
         return;
 
-    string field;
-
-    auto cb = [&](string line) -> bool
-    {
-        stringstream ss(line);
-        ss >> field;
-
-        if (field == "Uid:")
-        {
-            ss >> proc.uid >> proc.uid;
-            return false;
-        }
-
-        return true;
-    };
+    // Effective UID
+    KeyVal kv = {"Uid:", 1};
 
-    getLines("/proc/" + to_string(proc.pid) + (proc.tid ? "/task/" + to_string(proc.tid) : "") + "/status", proc, cb);
+    if (!scanKeyValsAt(dirFd, proc, "status", &kv, 1) && kv.found)
+        proc.uid = kv.val;
 }
 
 static string removeBlanks(string &str)
@@ -689,130 +2008,413 @@ static string removeBlanks(string &str)
     return str;
 }
 
-static int readLineInFile(string path, string &line)
+// Reads the first line (up to '\n' or EOF) of the file.
+static int readLineInFile(int dirFd, const char *file, string &line)
 {
-    ifstream file;
-    file.open(path);
+    int fd = openat(dirFd, file, O_RDONLY | O_CLOEXEC);
 
-    try
-    {
-        if (!file.good())
-            return 1;
-    }
-    catch (const std::ios::failure &)
-    {
+    if (fd < 0)
         return 1;
+
+    char buf[4096];
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+    {
+        char *nl = (char *)memchr(buf, '\n', len);
+        line.append(buf, nl ? nl - buf : len);
+
+        if (nl)
+            break;
     }
 
-    getline(file, line);
-    file.close();
+    close(fd);
     return 0;
 }
 
-static void getCmdline(Proc &proc)
+static void getCmdline(Proc &proc, int dirFd)
 {
-    if (proc.failed || !show_col_cmd)
+    // Cgroup rows show the cgroup name instead.
+    if (proc.failed || !show_col_cmd || (noProcs && cmdPatterns.empty()))
         return;
 
-    string path;
+    const char *file;
 
     if (proc.pid == 2 || proc.ppid == 2 || proc.tid)
         // "cmdline" is always empty for kernel threads.
-        path = "comm";
+        file = "comm";
     else
-        path = "cmdline";
+        file = "cmdline";
 
-    path = "/proc/" + to_string(proc.pid) + (proc.tid ? "/task/" + to_string(proc.tid) : "") + "/" + path;
     string line;
 
-    if (readLineInFile(path, line))
-        handleProcReadError(path, proc);
+    if (readLineInFile(dirFd, file, line))
+        handleProcReadError(procPath(proc, file), proc);
     else
         proc.cmdline = removeBlanks(line);
+
+    // While the cmdline is hot, and before the heavy files of a lazy scan.
+    if (!proc.failed && !proc.tid && !cmdPatterns.empty())
+        proc.cmdMatch = matchCmdline(proc.cmdline);
 }
 
-static void getPss(Proc &proc)
+static long getStatmRss(int dirFd, const char *file)
 {
-    if (proc.failed || proc.pid == 2 || proc.ppid == 2 || (!show_col_ram && !show_col_swap) || proc.tid)
-        return;
+    static const long pageSize = sysconf(_SC_PAGESIZE);
 
-    string path = "/proc/" + to_string(proc.pid) + "/smaps_rollup";
-    if (access(path.c_str(), F_OK) == -1)
-        path = "/proc/" + to_string(proc.pid) + "/smaps";
+    int fd = openat(dirFd, file, O_RDONLY | O_CLOEXEC);
 
-    string field;
-    long num, pss = 0, swapPss = 0;
+    if (fd < 0)
+        return -1;
+
+    char buf[128];
+    int len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (len <= 0)
+        return -1;
+
+    buf[len] = '\0';
+
+    // 2nd field (resident pages)
+    char *del = strchr(buf, ' ');
+    return del ? strtol(del + 1, nullptr, 10) * pageSize : -1;
+}
+
+static void getPss(Proc &proc, int dirFd)
+{
+    if (proc.failed || proc.pid == 2 || proc.ppid == 2 || (!show_col_ram && !show_col_swap) || proc.tid)
+        return;
+
+    errno = 0;
+
+    if (memSource == MEM_STATM)
+    {
+        long rss = getStatmRss(dirFd, "statm");
+
+        if (rss < 0)
+            handleProcReadError(procPath(proc, "statm"), proc);
+        else
+            proc.pss = rss;
+
+        return;
+    }
+
+    // Full smaps takes the mmap lock and lists every mapping.
+    const char *file = memSource == MEM_SMAPS ? "smaps" : "smaps_rollup";
+    int fd = openat(dirFd, file, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 && errno == ENOENT && memSource != MEM_SMAPS)
+    {
+        file = "smaps";
+        fd = openat(dirFd, file, O_RDONLY | O_CLOEXEC);
+    }
+
+    KeyVal kvs[] = {{SMAPS_MATCH_RAM.c_str()}, {SMAPS_MATCH_SWAP.c_str()}};
+
+    if (!scanKeyVals(fd, proc, file, kvs, 2, true))
+    {
+        proc.pss = kvs[0].val * 1024;
+        proc.swapPss = kvs[1].val * 1024;
+    }
+}
+
+// Resident size from statm, which is much cheaper than smaps, and not less
+// than PSS. Returns -1 if unknown.
+static long getStatmRss(const Proc &proc)
+{
+    char file[32];
+    snprintf(file, sizeof(file), "%d/statm", proc.pid);
+    return getStatmRss(procFd, file);
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// https://www.kernel.org/doc/html/latest/accounting/taskstats.html
+// The per-TGID aggregate carries CPU time, but not the I/O accounting, so
+// each thread is queried on its own (one message instead of opening and
+// parsing its io file). Querying requires CAP_NET_ADMIN.
+static int taskstatsFamily = -1;
+
+// One socket per worker thread, closed when the thread exits.
+struct NetlinkSocket
+{
+    int fd = -1;
+
+    ~NetlinkSocket()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+static thread_local NetlinkSocket taskstatsSock;
+
+struct GenlMsg
+{
+    struct nlmsghdr nl;
+    struct genlmsghdr genl;
+    char attrs[256];
+};
+
+#define GENL_ATTRS(msg) ((struct nlattr *)((char *)NLMSG_DATA(msg) + GENL_HDRLEN))
+#define NLA_DATA(nla) ((void *)((char *)(nla) + NLA_HDRLEN))
+#define NLA_NEXT(nla) ((struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+#define NLA_OK(nla, end) ((char *)(nla) + NLA_HDRLEN <= (end) && (char *)(nla) + (nla)->nla_len <= (end))
+
+// Sends a request with a single attribute and receives the reply into resp.
+// Returns the reply length, or -1 with errno set.
+static int genlRequest(int family, int cmd, int attrType, const void *data, int len, char *resp, size_t size)
+{
+    int &fd = taskstatsSock.fd;
 
-    auto cb = [&](string line) -> bool
+    if (fd < 0)
     {
-        stringstream ss(line);
-        ss >> field;
+        if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC)) < 0)
+            return -1;
 
-        if (field == SMAPS_MATCH_RAM)
+        struct sockaddr_nl addr = {};
+        addr.nl_family = AF_NETLINK;
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
         {
-            ss >> num;
-            pss += num;
+            close(fd);
+            return fd = -1;
         }
-        else if (field == SMAPS_MATCH_SWAP)
+    }
+
+    GenlMsg msg = {};
+    msg.nl.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    msg.nl.nlmsg_type = family;
+    msg.nl.nlmsg_flags = NLM_F_REQUEST;
+    msg.genl.cmd = cmd;
+    msg.genl.version = 1;
+
+    struct nlattr *nla = GENL_ATTRS(&msg.nl);
+    nla->nla_type = attrType;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy(NLA_DATA(nla), data, len);
+
+    msg.nl.nlmsg_len += NLA_ALIGN(nla->nla_len);
+
+    if (send(fd, &msg, msg.nl.nlmsg_len, 0) < 0)
+        return -1;
+
+    int res = recv(fd, resp, size, 0);
+
+    if (res < 0)
+        return -1;
+
+    struct nlmsghdr *nl = (struct nlmsghdr *)resp;
+
+    if (!NLMSG_OK(nl, res))
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (nl->nlmsg_type == NLMSG_ERROR)
+    {
+        errno = -((struct nlmsgerr *)NLMSG_DATA(nl))->error;
+        return -1;
+    }
+
+    return res;
+}
+
+// Returns the attribute of given type, or nullptr.
+static struct nlattr *findAttr(struct nlattr *nla, char *end, int type)
+{
+    for (; NLA_OK(nla, end); nla = NLA_NEXT(nla))
+    {
+        if ((nla->nla_type & NLA_TYPE_MASK) == type)
+            return nla;
+    }
+
+    return nullptr;
+}
+
+static int getTaskstats(pid_t tid, struct taskstats &stats)
+{
+    char resp[1024];
+
+    __u32 id = tid;
+    int len = genlRequest(taskstatsFamily, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_PID, &id, sizeof(id), resp, sizeof(resp));
+
+    if (len < 0)
+        return 1;
+
+    struct nlmsghdr *nl = (struct nlmsghdr *)resp;
+    char *end = (char *)nl + min((__u32)len, nl->nlmsg_len);
+
+    struct nlattr *nla = findAttr(GENL_ATTRS(nl), end, TASKSTATS_TYPE_AGGR_PID);
+
+    if (nla)
+        nla = findAttr((struct nlattr *)NLA_DATA(nla), (char *)nla + nla->nla_len, TASKSTATS_TYPE_STATS);
+
+    if (!nla)
+    {
+        errno = EBADMSG;
+        return 1;
+    }
+
+    // Older kernels have a shorter struct.
+    stats = {};
+    memcpy(&stats, NLA_DATA(nla), min(sizeof(stats), (size_t)(nla->nla_len - NLA_HDRLEN)));
+    return 0;
+}
+
+// Resolves the taskstats family, and checks that we are allowed to query.
+static int initTaskstats()
+{
+    char resp[1024];
+
+    int len = genlRequest(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME,
+                          sizeof(TASKSTATS_GENL_NAME), resp, sizeof(resp));
+
+    if (len < 0)
+        return 1;
+
+    struct nlmsghdr *nl = (struct nlmsghdr *)resp;
+    struct nlattr *nla = findAttr(GENL_ATTRS(nl), (char *)nl + min((__u32)len, nl->nlmsg_len), CTRL_ATTR_FAMILY_ID);
+
+    if (!nla)
+    {
+        errno = EBADMSG;
+        return 1;
+    }
+
+    taskstatsFamily = *(__u16 *)NLA_DATA(nla);
+
+    struct taskstats stats;
+    return getTaskstats(gettid(), stats);
+}
+
+// Thread rows are printed with --threads, except for kernel threads.
+static bool hasThreadRows(const Proc &proc)
+{
+    return !skipThreads && !proc.tid && proc.pid != 2 && proc.ppid != 2;
+}
+
+static bool createProc(Proc &proc, pid_t pid, pid_t tid = 0);
+
+// Reads all the threads of a process for the thread rows. A thread which
+// exited in between is skipped.
+static void getThreads(Proc &proc, int dirFd)
+{
+    proc.threads.clear();
+
+    if (proc.failed || !hasThreadRows(proc))
+        return;
+
+    int taskFd = openat(dirFd, "task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    auto cb = [&](pid_t tid) -> bool
+    {
+        Proc thread;
+        createProc(thread, proc.pid, tid);
+
+        if (!thread.failed)
+            proc.threads.push_back(move(thread));
+        else if (errno != ENOENT && errno != ESRCH && (show_col_rio || show_col_wio))
         {
-            ss >> num;
-            swapPss += num;
+            // The I/O sum of the process would be incomplete.
+            handleProcReadError(procPath(proc, "task"), proc);
+            return false;
         }
 
         return true;
     };
 
-    if (!getLines(path, proc, cb))
+    if (taskFd < 0 || parseProcTree(taskFd, cb))
     {
-        proc.pss = pss * 1024;
-        proc.swapPss = swapPss * 1024;
+        if (!proc.failed)
+            handleProcReadError(procPath(proc, "task"), proc);
     }
+
+    if (taskFd >= 0)
+        close(taskFd);
 }
 
-static void getIo(Proc &proc)
+static void getIo(Proc &proc, int dirFd)
 {
     if (proc.failed || (!show_col_rio && !show_col_wio))
         return;
 
-    string field;
-    long long num, readIO = 0, writeIO = 0;
+    long long readIO = 0, writeIO = 0;
 
-    auto cb = [&](string line) -> bool
+    // A thread which exited in between is skipped, like a missing io file.
+    auto readTaskstats = [&](pid_t tid) -> int
     {
-        stringstream ss(line);
-        ss >> field;
+        struct taskstats stats;
 
-        if (field == "read_bytes:")
-        {
-            ss >> num;
-            readIO += num;
-        }
-        else if (field == "write_bytes:")
-        {
-            ss >> num;
-            writeIO += num;
-        }
+        if (getTaskstats(tid, stats))
+            return errno == ESRCH ? 0 : handleProcReadError(procPath(proc, "taskstats"), proc);
 
-        return true;
+        readIO += stats.read_bytes;
+        writeIO += stats.write_bytes;
+
+        if (proc.tid && show_col_cpu)
+            proc.cpuTime = (stats.ac_utime + stats.ac_stime) / 1000;
+
+        return 0;
+    };
+
+    auto readIoFile = [&](int fd, const char *file) -> int
+    {
+        KeyVal kvs[] = {{"read_bytes:"}, {"write_bytes:"}};
+
+        if (scanKeyVals(fd, proc, file, kvs, 2))
+            return 1;
+
+        readIO += kvs[0].val;
+        writeIO += kvs[1].val;
+        return 0;
     };
 
     int err;
 
-    if (totalIo || proc.tid)
-        err = getLines("/proc/" + to_string(proc.pid) + (proc.tid ? "/task/" + to_string(proc.tid) : "") + "/io", proc, cb);
+    if (useTaskstats && proc.tid)
+        err = readTaskstats(proc.tid);
+    else if (totalIo || proc.tid)
+        err = readIoFile(openat(dirFd, "io", O_RDONLY | O_CLOEXEC), "io");
+    else if (hasThreadRows(proc))
+    {
+        // The task directory has already been read for the thread rows.
+        err = proc.threads.empty();
+
+        for (Proc &thread : proc.threads)
+        {
+            readIO += thread.readIO;
+            writeIO += thread.writeIO;
+        }
+    }
     else
     {
         err = 0;
 
-        string taskDir = "/proc/" + to_string(proc.pid) + "/task/";
+        int taskFd = openat(dirFd, "task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
         auto tidCb = [&](pid_t tid) -> bool
         {
-            err = getLines(taskDir + to_string(tid) + "/io", proc, cb) || err;
+            if (useTaskstats)
+            {
+                err = readTaskstats(tid) || err;
+                return true;
+            }
+
+            char file[32];
+            snprintf(file, sizeof(file), "task/%d/io", tid);
+
+            err = readIoFile(openat(dirFd, file, O_RDONLY | O_CLOEXEC), file) || err;
             return true;
         };
 
-        if (parseProcTree(taskDir, tidCb, false))
-            err = handleProcReadError(taskDir, proc);
+        if (taskFd < 0 || parseProcTree(taskFd, tidCb))
+            err = handleProcReadError(procPath(proc, "task"), proc);
+
+        if (taskFd >= 0)
+            close(taskFd);
     }
 
     if (!err)
@@ -822,373 +2424,3803 @@ static void getIo(Proc &proc)
     }
 }
 
-static map<uid_t, string> userNames;
+static map<uid_t, IStr> userNames;
 
-static string getUserName(uid_t uid)
+static IStr getUserName(uid_t uid)
 {
     if (noName)
         return to_string(uid);
 
-    if (userNames.find(uid) != userNames.end())
-        return userNames[uid];
+    auto it = userNames.find(uid);
+    if (it != userNames.end())
+        return it->second;
 
     string user;
 
+    // Not truncated here, the machine-readable output needs the full name.
     struct passwd *pw = getpwuid(uid);
     if (pw)
-    {
         user = pw->pw_name;
-        if ((int)user.length() > col_wid_uid - 2)
-            user = user.substr(0, col_wid_uid - 3) + "+";
-    }
     else
         user = to_string(uid);
 
-    userNames.insert({uid, user});
+    return userNames.insert({uid, user}).first->second;
+}
 
-    return user;
+// Returns true if the process is to be added to the tree.
+// Reads the files which are not required to build the tree and to match the args.
+static void loadProc(Proc &proc, int dirFd)
+{
+    parseStatus(proc, dirFd);
+    if (!proc.tid)
+        getPss(proc, dirFd);
+    getThreads(proc, dirFd);
+    getIo(proc, dirFd);
 }
 
-static set<pid_t> skippedKernelProc;
+// The v2 entry ("0::<path>"), which is there in the hybrid layout too.
+static void getCgroup(Proc &proc, int dirFd)
+{
+    if (proc.failed || proc.tid || groupKey != GROUP_CGROUP)
+        return;
+
+    int fd = openat(dirFd, "cgroup", O_RDONLY | O_CLOEXEC);
+
+    char buf[4096];
+    ssize_t len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+
+    if (fd >= 0)
+        close(fd);
+
+    if (len < 0)
+    {
+        handleProcReadError(procPath(proc, "cgroup"), proc);
+        return;
+    }
+
+    buf[len] = '\0';
+
+    const char *path = strncmp(buf, "0::", 3) ? nullptr : buf + 3;
+
+    if (!path && (path = strstr(buf, "\n0::")))
+        path += 4;
+
+    // Only v1 hierarchies
+    if (!path)
+        path = "/";
+
+    const char *end = strchr(path, '\n');
+    proc.cgroup = string_view(path, end ? end - path : strlen(path));
+}
+
+static bool createProc(Proc &proc, pid_t pid, pid_t tid)
+{
+    if (skipKernel && pid == 2)
+    {
+        (scanBuf ? scanBuf->skippedKernelProc : skippedKernelProc).insert(pid);
+        return false;
+    }
+
+    proc.pid = pid;
+    proc.tid = tid;
+
+    // All files are read relative to the same directory handle. If the pid
+    // is reused in between, reads fail instead of mixing up two processes.
+    char dir[32];
+
+    if (tid)
+        snprintf(dir, sizeof(dir), "%d/task/%d", pid, tid);
+    else
+        snprintf(dir, sizeof(dir), "%d", pid);
+
+    errno = 0;
+    int dirFd = openat(procFd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirFd < 0)
+    {
+        handleProcReadError(procPath(proc), proc);
+        return false;
+    }
+
+    parseStat(proc, dirFd);
+    if (!tid && skipKernel && proc.ppid == 2)
+    {
+        close(dirFd);
+        (scanBuf ? scanBuf->skippedKernelProc : skippedKernelProc).insert(pid);
+        return false;
+    }
+
+    getCmdline(proc, dirFd);
+    getCgroup(proc, dirFd);
+    if (!lazyLoad || tid)
+        loadProc(proc, dirFd);
+
+    close(dirFd);
+    return !tid && !proc.failed;
+}
+
+// Returns -1 if pid is neither in the table nor a parent of a process in it.
+static int findRow(pid_t pid)
+{
+    if (pidIndex.empty())
+        return -1;
+
+    size_t mask = pidIndex.size() - 1;
+
+    for (size_t i = pid & mask;; i = (i + 1) & mask)
+    {
+        int row = pidIndex[i];
+        if (row < 0 || rowPids[row] == pid)
+            return row;
+    }
+}
+
+static Proc *findProc(pid_t pid)
+{
+    int row = findRow(pid);
+    return row >= 0 && (size_t)row < procTable.size() ? &procTable[row] : nullptr;
+}
+
+// Returns the row of pid, adding one if not found.
+static int insertRow(pid_t pid)
+{
+    size_t mask = pidIndex.size() - 1;
+    size_t i = pid & mask;
+
+    for (; pidIndex[i] >= 0; i = (i + 1) & mask)
+    {
+        if (rowPids[pidIndex[i]] == pid)
+            return pidIndex[i];
+    }
+
+    pidIndex[i] = rowPids.size();
+    rowPids.push_back(pid);
+    return pidIndex[i];
+}
+
+// Rebuilds the pid index and the children ranges in one pass over the table.
+static int indexProcs()
+{
+    long long start = monotonicNs();
+    size_t count = procTable.size();
+
+    // Pids are mostly sequential, so the low bits hardly collide. There can
+    // be twice as many rows as processes (if no parent is in the table).
+    size_t size = 64;
+    while (size < 4 * count)
+        size <<= 1;
+
+    pidIndex.assign(size, -1);
+    rowPids.clear();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (insertRow(procTable[i].pid) != (int)i)
+            return printErr("Failed to build proc map");
+    }
+
+    vector<int> parentRows(count);
+
+    for (size_t i = 0; i < count; i++)
+        parentRows[i] = insertRow(procTable[i].ppid);
+
+    size_t rows = rowPids.size();
+    childStart.assign(rows + 1, 0);
+
+    for (int row : parentRows)
+        childStart[row + 1]++;
+
+    for (size_t row = 0; row < rows; row++)
+        childStart[row + 1] += childStart[row];
+
+    // Children are kept in table order.
+    vector<int> next(childStart.begin(), childStart.end() - 1);
+    childRows.resize(count);
+
+    for (size_t i = 0; i < count; i++)
+        childRows[next[parentRows[i]]++] = i;
+
+    rootRows.clear();
+
+    for (size_t row = 0; row < rows; row++)
+    {
+        if (childStart[row + 1] > childStart[row])
+            rootRows.push_back(row);
+    }
+
+    sort(rootRows.begin(), rootRows.end(), [](int a, int b)
+         { return rowPids[a] < rowPids[b]; });
+
+    treeNs += monotonicNs() - start;
+    return 0;
+}
+
+// Drops the processes marked failed (exited), and rebuilds the index.
+static int pruneProcs()
+{
+    procTable.erase(remove_if(procTable.begin(), procTable.end(), [](Proc &proc)
+                              { return proc.failed; }),
+                    procTable.end());
+
+    return indexProcs();
+}
+
+// Number of items a worker takes from the list at a time.
+static constexpr size_t SCAN_CHUNK = 32;
+
+// Calls fn(i, buf) for every i in [0, count) on up to 'jobs' threads, each
+// with its own buffer. The calling thread is one of the workers.
+static vector<ScanBuffer> runJobs(size_t count, auto fn)
+{
+    size_t threads = min((size_t)jobs, (count + SCAN_CHUNK - 1) / SCAN_CHUNK);
+    vector<ScanBuffer> bufs(max(threads, (size_t)1));
+
+    atomic<size_t> next(0);
+
+    auto worker = [&](ScanBuffer *buf)
+    {
+        scanBuf = buf;
+
+        size_t i;
+        while ((i = next.fetch_add(SCAN_CHUNK)) < count)
+        {
+            for (size_t end = min(i + SCAN_CHUNK, count); i < end; i++)
+                fn(i, *buf);
+        }
+
+        scanBuf = nullptr;
+    };
+
+    vector<thread> workers;
+
+    for (size_t i = 1; i < bufs.size(); i++)
+    {
+        try
+        {
+            workers.emplace_back(worker, &bufs[i]);
+        }
+        catch (const system_error &)
+        {
+            // The calling thread and already running workers take up the rest.
+            break;
+        }
+    }
+
+    worker(&bufs[0]);
+
+    for (thread &t : workers)
+        t.join();
+
+    return bufs;
+}
+
+static int updateUptime()
+{
+    if (!show_col_age && !show_col_cpu && !sampled)
+        return 0;
+
+    if (procRoot == "/proc")
+    {
+        if (sysinfo(&sInfo))
+            return printErrCode("Failed to get sysinfo");
+
+        return 0;
+    }
+
+    // A custom procfs root has its own clock.
+    string uptime;
+
+    if (readLineInFile(procFd, "uptime", uptime))
+        return printErrCode("Failed to read " + procRoot + "/uptime");
+
+    sInfo.uptime = strtol(uptime.c_str(), nullptr, 10);
+    return 0;
+}
+
+static int listPids(vector<pid_t> &pids)
+{
+    if (procFd < 0 && (procFd = open(procRoot.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return printErrCode("Failed to read " + procRoot);
+
+    if (parseProcTree(procFd, [&](pid_t pid) -> bool
+                      {
+                        pids.push_back(pid);
+                        return true; }))
+        return printErrCode("Failed to read " + procRoot);
+
+    return updateUptime();
+}
+
+static int collectProcs(vector<pid_t> &pids)
+{
+    auto bufs = runJobs(pids.size(), [&](size_t i, ScanBuffer &buf)
+                        {
+                            Proc proc;
+                            if (createProc(proc, pids[i]))
+                                buf.procs.push_back({i, proc}); });
+
+    // Merge in /proc order so that the output does not depend on the number of jobs.
+    vector<Proc *> ordered(pids.size(), nullptr);
+
+    for (ScanBuffer &buf : bufs)
+    {
+        for (auto &pair : buf.procs)
+            ordered[pair.first] = &pair.second;
+
+        errMap.merge(buf.errMap);
+        skippedKernelProc.merge(buf.skippedKernelProc);
+    }
+
+    for (Proc *proc : ordered)
+    {
+        if (proc)
+            procTable.push_back(move(*proc));
+    }
+
+    return indexProcs();
+}
+
+static int scanProcs()
+{
+    long long start = monotonicNs(), tree = treeNs;
+
+    vector<pid_t> pids;
+    int res = listPids(pids) || collectProcs(pids);
+
+    scanNs += monotonicNs() - start - (treeNs - tree);
+    return res;
+}
+
+// Reads only the given pids (and their parents with --ancestors), one hop
+// at a time, instead of all of /proc.
+static int scanPids(char **args, int count)
+{
+    long long start = monotonicNs(), tree = treeNs;
+
+    if (procFd < 0 && (procFd = open(procRoot.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return printErrCode("Failed to read " + procRoot);
+
+    if (updateUptime())
+        return 1;
+
+    set<pid_t> seen;
+
+    for (int i = 0; i < count; i++)
+    {
+        for (pid_t pid = stoi(args[i]); pid > 0 && seen.insert(pid).second;)
+        {
+            Proc proc;
+
+            if (!createProc(proc, pid))
+                break;
+
+            pid = ancestors ? proc.ppid : 0;
+            procTable.push_back(move(proc));
+        }
+    }
+
+    // In /proc order, as with a full scan.
+    sort(procTable.begin(), procTable.end(), [](const Proc &a, const Proc &b)
+         { return a.pid < b.pid; });
+
+    int res = indexProcs();
+
+    scanNs += monotonicNs() - start - (treeNs - tree);
+    return res;
+}
+
+// Table rows of the given processes and their child trees.
+static vector<int> matchedRows(set<pid_t> &pidList)
+{
+    vector<int> rows;
+    vector<char> added(procTable.size());
+
+    for (pid_t pid : pidList)
+    {
+        int row = findRow(pid);
+
+        if (row >= 0 && (size_t)row < procTable.size() && !added[row])
+        {
+            added[row] = true;
+            rows.push_back(row);
+        }
+    }
+
+    // The subtree sums need the child trees even if they are not printed.
+    for (size_t i = 0; (!noTree || cumulative) && i < rows.size(); i++)
+    {
+        for (int j = childStart[rows[i]]; j < childStart[rows[i] + 1]; j++)
+        {
+            int child = childRows[j];
+
+            if (!added[child])
+            {
+                added[child] = true;
+                rows.push_back(child);
+            }
+        }
+    }
+
+    return rows;
+}
+
+// Table rows of the given processes and their parents.
+static vector<int> ancestorRows(set<pid_t> &pidList)
+{
+    vector<int> rows;
+    vector<char> added(procTable.size());
+
+    for (pid_t pid : pidList)
+    {
+        for (int row = findRow(pid); row >= 0 && (size_t)row < procTable.size() && !added[row]; row = findRow(procTable[row].ppid))
+        {
+            added[row] = true;
+            rows.push_back(row);
+        }
+    }
+
+    return rows;
+}
+
+// Second phase of a lazy scan: reads the rest of the files for the given
+// table rows. The ones which exited (or the pid has been reused) since the
+// first phase are marked failed.
+static void loadRows(vector<int> &rows)
+{
+    long long start = monotonicNs();
+
+    auto bufs = runJobs(rows.size(), [&](size_t i, ScanBuffer &)
+                        {
+                            Proc &proc = procTable[rows[i]];
+
+                            char dir[16];
+                            snprintf(dir, sizeof(dir), "%d", proc.pid);
+
+                            errno = 0;
+                            int dirFd = openat(procFd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+                            if (dirFd < 0)
+                            {
+                                handleProcReadError(procPath(proc), proc);
+                                return;
+                            }
+
+                            Proc cur;
+                            cur.pid = proc.pid;
+                            parseStat(cur, dirFd, true);
+
+                            if (cur.failed || cur.startTime != proc.startTime)
+                                proc.failed = true;
+                            else
+                                loadProc(proc, dirFd);
+
+                            close(dirFd); });
+
+    for (ScanBuffer &buf : bufs)
+        errMap.merge(buf.errMap);
+
+    scanNs += monotonicNs() - start;
+}
+
+// Loads the given processes and their child trees, and drops the failed ones.
+static int loadProcs(set<pid_t> &pidList)
+{
+    vector<int> rows = matchedRows(pidList);
+    loadRows(rows);
+    return pruneProcs();
+}
+
+// Re-reads the volatile fields and stores their change since the
+// previous sample. Returns false if the process is gone (or the pid has
+// been reused in between). The slow (RAM and SWAP) and rarely changing
+// (cmdline, uid) fields are re-read only if asked.
+static bool sampleProc(Proc &proc, bool slow)
+{
+    Proc cur;
+    cur.pid = proc.pid;
+
+    char dir[16];
+    snprintf(dir, sizeof(dir), "%d", proc.pid);
+
+    errno = 0;
+    int dirFd = openat(procFd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirFd < 0)
+        return false;
+
+    parseStat(cur, dirFd, true);
+    getThreads(cur, dirFd);
+    getIo(cur, dirFd);
+
+    if (slow)
+    {
+        parseStatus(cur, dirFd);
+        getCmdline(cur, dirFd);
+        getPss(cur, dirFd);
+    }
+
+    close(dirFd);
+
+    if (cur.failed || cur.startTime != proc.startTime)
+        return false;
+
+    // Reparented, or moved to another group or session.
+    proc.ppid = cur.ppid;
+    proc.pgid = cur.pgid;
+    proc.sid = cur.sid;
+
+    if (slow)
+    {
+        proc.uid = cur.uid;
+        proc.cmdline = cur.cmdline;
+        proc.cmdMatch = cur.cmdMatch;
+        proc.pss = cur.pss;
+        proc.swapPss = cur.swapPss;
+    }
+
+    // At least 1 ms to avoid division by zero.
+    proc.sampleMs = max((cur.sampleTime - proc.sampleTime) / 1000000, 1LL);
+    proc.sampleTime = cur.sampleTime;
+
+    proc.cpuDelta = cur.cpuTime - proc.cpuTime;
+    proc.readDelta = cur.readIO - proc.readIO;
+    proc.writeDelta = cur.writeIO - proc.writeIO;
+    proc.minFltDelta = cur.minFlt - proc.minFlt;
+    proc.majFltDelta = cur.majFlt - proc.majFlt;
+
+    proc.cpuTime = cur.cpuTime;
+    proc.readIO = cur.readIO;
+    proc.writeIO = cur.writeIO;
+    proc.minFlt = cur.minFlt;
+    proc.majFlt = cur.majFlt;
+
+    proc.threads = move(cur.threads);
+
+    return true;
+}
+
+// Takes the next sample of the given table rows, with the slow fields if
+// marked. The processes which exited in between are dropped, and the index
+// is rebuilt for the reparented ones.
+static int sampleProcs(vector<pair<int, bool>> &rows)
+{
+    runJobs(rows.size(), [&](size_t i, ScanBuffer &)
+            {
+                Proc &proc = procTable[rows[i].first];
+                if (!sampleProc(proc, rows[i].second))
+                    proc.failed = true; });
+
+    return pruneProcs();
+}
+
+// The ones born in between are created with their whole lifetime as the sample.
+static int addNewProcs(vector<pid_t> &newPids)
+{
+    if (collectProcs(newPids))
+        return 1;
+
+    for (pid_t pid : newPids)
+    {
+        Proc *p = findProc(pid);
+        if (!p)
+            continue;
+
+        Proc &proc = *p;
+
+        proc.sampleMs = max(proc.age, 1L);
+        proc.cpuDelta = proc.cpuTime;
+        proc.readDelta = proc.readIO;
+        proc.writeDelta = proc.writeIO;
+        proc.minFltDelta = proc.minFlt;
+        proc.majFltDelta = proc.majFlt;
+    }
+
+    return 0;
+}
+
+// Arena size after the last compactStrings()
+static size_t compactedBytes = 0;
+
+// Rebuilds the string arena from the live handles: in the table, in the
+// caches, and the ones extra(relink) relinks. Done once the arena has grown
+// to twice its size after the previous rebuild, with pids which come and
+// go. Other handles are invalid after it.
+static void compactStrings(auto extra)
+{
+    size_t bytes = 0;
+    for (InternShard &shard : internShards)
+        bytes += shard.bytes;
+
+    if (bytes < 2 * compactedBytes + INTERN_SHARDS * INTERN_BLOCK)
+        return;
+
+    vector<char *> oldBlocks;
+
+    for (InternShard &shard : internShards)
+    {
+        oldBlocks.insert(oldBlocks.end(), shard.blocks.begin(), shard.blocks.end());
+        shard.blocks.clear();
+        shard.strings.clear();
+        shard.block = nullptr;
+        shard.blockLeft = shard.bytes = 0;
+    }
+
+    // Interned again while the old copy is still there.
+    auto relink = [](IStr &str)
+    { str = str.view(); };
+
+    auto relinkProc = [&](Proc &proc)
+    {
+        relink(proc.tty);
+        relink(proc.cmdline);
+        relink(proc.cgroup);
+    };
+
+    for (Proc &proc : procTable)
+    {
+        relinkProc(proc);
+
+        for (Proc &thread : proc.threads)
+            relinkProc(thread);
+    }
+
+    for (auto &pair : ttyNames)
+        relink(pair.second);
+
+    for (auto &pair : userNames)
+        relink(pair.second);
+
+    relink(NO_TTY);
+    relink(DASH);
+
+    extra(relinkProc);
+
+    for (char *block : oldBlocks)
+        delete[] block;
+
+    compactedBytes = 0;
+    for (InternShard &shard : internShards)
+        compactedBytes += shard.bytes;
+}
+
+static void compactStrings()
+{
+    compactStrings([](auto &) {});
+}
+
+static int refreshProcs(bool slow)
+{
+    errMap.clear();
+
+    vector<pair<int, bool>> rows;
+    for (size_t i = 0; i < procTable.size(); i++)
+        rows.push_back({i, slow});
+
+    if (sampleProcs(rows))
+        return 1;
+
+    vector<pid_t> pids, newPids;
+
+    if (listPids(pids))
+        return 1;
+
+    set<pid_t> skipped;
+
+    for (pid_t pid : pids)
+    {
+        if (skippedKernelProc.find(pid) != skippedKernelProc.end())
+            skipped.insert(pid);
+        else if (!findProc(pid))
+            newPids.push_back(pid);
+    }
+
+    // Forget the dead kernel threads, their pids may be reused.
+    skippedKernelProc.swap(skipped);
+
+    return addNewProcs(newPids);
+}
+
+// The age is not re-read when sampling. It follows the uptime which the
+// refresh has read.
+static void updateAges()
+{
+    for (Proc &proc : procTable)
+    {
+        proc.age = 1000 * sInfo.uptime - 1000 * proc.startTime / SC_CLK_TCK;
+
+        for (Proc &thread : proc.threads)
+            thread.age = 1000 * sInfo.uptime - 1000 * thread.startTime / SC_CLK_TCK;
+    }
+}
+
+// Drops the table and scans again, e.g. to pick up cgroup moves.
+static int rescanProcs()
+{
+    procTable.clear();
+    errMap.clear();
+    skippedKernelProc.clear();
+
+    return scanProcs();
+}
+
+// Takes the second sample after intervalMs.
+static int sampleInterval()
+{
+    this_thread::sleep_for(chrono::milliseconds(intervalMs));
+
+    long long start = monotonicNs(), tree = treeNs;
+    int res = refreshProcs(false);
+
+    scanNs += monotonicNs() - start - (treeNs - tree);
+    return res;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// Snapshot file (--save, --load) in host byte order: the header, fixed
+// size records (each process followed by its threads), and the string
+// table which the records point into.
+static constexpr char SNAP_MAGIC[4] = {'P', 'S', 'T', 'S'};
+static constexpr uint32_t SNAP_VERSION = 1;
+
+// Saved with --rss and --total-io.
+static constexpr uint32_t SNAP_RSS = 1, SNAP_TOTAL_IO = 2;
+
+struct SnapHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t headerSize, recordSize;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t recordCount, stringsSize;
+    int64_t savedAt; // unix time, sec
+};
+
+struct SnapRecord
+{
+    int32_t pid, tid, ppid, pgid, sid;
+    uint32_t uid;
+    int64_t minFlt, majFlt, cpuTime, startTime, age, pss, swapPss, readIO, writeIO;
+    uint32_t tty, ttyLen, cmdline, cmdlineLen; // offset and length in the string table
+};
+
+static_assert(sizeof(SnapHeader) == 48 && sizeof(SnapRecord) == 112, "Snapshot layout changed");
+
+static void addSnapRecord(const Proc &proc, vector<SnapRecord> &records, string &strings,
+                          unordered_map<const char *, uint32_t> &stringOffsets)
+{
+    // Equal strings have equal handles.
+    auto addString = [&](IStr str, uint32_t &offset, uint32_t &len)
+    {
+        auto it = stringOffsets.find(str.c_str());
+
+        if (it == stringOffsets.end())
+        {
+            it = stringOffsets.insert({str.c_str(), strings.length()}).first;
+            strings += str;
+        }
+
+        offset = it->second;
+        len = str.length();
+    };
+
+    SnapRecord rec = {};
+    rec.pid = proc.pid;
+    rec.tid = proc.tid;
+    rec.ppid = proc.ppid;
+    rec.pgid = proc.pgid;
+    rec.sid = proc.sid;
+    rec.uid = proc.uid;
+    rec.minFlt = proc.minFlt;
+    rec.majFlt = proc.majFlt;
+    rec.cpuTime = proc.cpuTime;
+    rec.startTime = proc.startTime;
+    rec.age = proc.age;
+    rec.pss = proc.pss;
+    rec.swapPss = proc.swapPss;
+    rec.readIO = proc.readIO;
+    rec.writeIO = proc.writeIO;
+
+    addString(proc.tty, rec.tty, rec.ttyLen);
+    addString(proc.cmdline, rec.cmdline, rec.cmdlineLen);
+
+    records.push_back(rec);
+}
+
+// Returns false if the strings are out of the string table.
+static bool readSnapRecord(const SnapRecord &rec, const char *strings, uint64_t stringsSize, Proc &proc)
+{
+    if ((uint64_t)rec.tty + rec.ttyLen > stringsSize || (uint64_t)rec.cmdline + rec.cmdlineLen > stringsSize)
+        return false;
+
+    proc.pid = rec.pid;
+    proc.tid = rec.tid;
+    proc.ppid = rec.ppid;
+    proc.pgid = rec.pgid;
+    proc.sid = rec.sid;
+    proc.uid = rec.uid;
+    proc.minFlt = rec.minFlt;
+    proc.majFlt = rec.majFlt;
+    proc.cpuTime = rec.cpuTime;
+    proc.startTime = rec.startTime;
+    proc.age = rec.age;
+    proc.pss = rec.pss;
+    proc.swapPss = rec.swapPss;
+    proc.readIO = rec.readIO;
+    proc.writeIO = rec.writeIO;
+    proc.tty = string_view(strings + rec.tty, rec.ttyLen);
+    proc.cmdline = string_view(strings + rec.cmdline, rec.cmdlineLen);
+
+    return true;
+}
+
+static bool writeAll(int fd, const void *buf, size_t len, off_t offset)
+{
+    for (const char *p = (const char *)buf; len;)
+    {
+        ssize_t res = pwrite(fd, p, len, offset);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+
+        if (res <= 0)
+            return false;
+
+        p += res;
+        len -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+// Writes to a temporary file first, so that a reader never sees a partial snapshot.
+static int saveSnapshot()
+{
+    vector<SnapRecord> records;
+    string strings;
+    unordered_map<const char *, uint32_t> stringOffsets;
+
+    for (size_t i = 0; i < procTable.size(); i++)
+    {
+        addSnapRecord(procTable[i], records, strings, stringOffsets);
+
+        for (Proc &thread : procTable[i].threads)
+            addSnapRecord(thread, records, strings, stringOffsets);
+    }
+
+    SnapHeader hdr = {};
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAP_VERSION;
+    hdr.headerSize = sizeof(SnapHeader);
+    hdr.recordSize = sizeof(SnapRecord);
+    hdr.flags = (rssMem ? SNAP_RSS : 0) | (totalIo ? SNAP_TOTAL_IO : 0);
+    hdr.recordCount = records.size();
+    hdr.stringsSize = strings.length();
+    hdr.savedAt = time(nullptr);
+
+    string tmpFile = (string)saveFile + ".tmp";
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return printErrCode("Failed to create " + tmpFile);
+
+    size_t recordsSize = records.size() * sizeof(SnapRecord);
+
+    if (!writeAll(fd, &hdr, sizeof(hdr), 0) || !writeAll(fd, records.data(), recordsSize, sizeof(hdr)) ||
+        !writeAll(fd, strings.data(), strings.length(), sizeof(hdr) + recordsSize))
+    {
+        printErrCode("Failed to write " + tmpFile);
+        close(fd);
+        unlink(tmpFile.c_str());
+        return 1;
+    }
+
+    if (close(fd) || rename(tmpFile.c_str(), saveFile))
+    {
+        printErrCode("Failed to save " + (string)saveFile);
+        unlink(tmpFile.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+// Recording (--record) in host byte order: the header, and a ring of
+// frames after it. A frame is a FrameHeader, the records, the pids which
+// exited, and the string table, padded to 8 bytes. Keyframes have all the
+// processes, delta frames only the ones which appeared or changed since the
+// previous frame. The oldest frame in the ring is always a keyframe, and a
+// frame which does not fit at the end of the ring starts over at its
+// beginning, after a FRAME_WRAP marker if there's room for it.
+static constexpr char REC_MAGIC[4] = {'P', 'S', 'T', 'R'};
+static constexpr uint32_t REC_VERSION = 1;
+
+static constexpr uint32_t FRAME_KEY = 1, FRAME_DELTA = 2, FRAME_WRAP = 3;
+
+// Bounds the number of deltas to replay. A keyframe is also written after
+// a quarter of the ring, so that overwriting the oldest keyframe (and its
+// deltas) does not empty most of the ring.
+static constexpr int KEYFRAME_INTERVAL = 60;
+
+struct RecHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t headerSize, recordSize;
+    uint32_t flags; // SNAP_RSS, SNAP_TOTAL_IO
+    uint32_t clkTck;
+    uint64_t capacity;   // ring size
+    uint64_t head, tail; // ring offsets of the oldest frame, and after the newest
+    uint64_t frameCount;
+};
+
+struct FrameHeader
+{
+    uint32_t type;
+    uint32_t recordCount, exitCount, stringsSize;
+    uint64_t size;  // including the header and padding
+    int64_t time;   // unix time, millisec
+    int64_t uptime; // sec
+};
+
+static_assert(sizeof(RecHeader) == 56 && sizeof(FrameHeader) == 40, "Recording layout changed");
+
+// Returns the frame at pos in the ring, moving pos to the ring start if
+// the frame has wrapped. Returns nullptr if the frame is out of the ring.
+static const FrameHeader *getFrame(const char *ring, uint64_t ringSize, uint64_t capacity, uint64_t &pos)
+{
+    if (pos > capacity)
+        return nullptr;
+
+    if (capacity - pos < sizeof(FrameHeader) ||
+        (pos + sizeof(FrameHeader) <= ringSize && ((const FrameHeader *)(ring + pos))->type == FRAME_WRAP))
+        pos = 0;
+
+    if (pos + sizeof(FrameHeader) > ringSize)
+        return nullptr;
+
+    const FrameHeader *frame = (const FrameHeader *)(ring + pos);
+
+    if ((frame->type != FRAME_KEY && frame->type != FRAME_DELTA) || frame->size % 8 ||
+        frame->size > ringSize - pos ||
+        frame->size < sizeof(FrameHeader) + (uint64_t)frame->recordCount * sizeof(SnapRecord) +
+                          (uint64_t)frame->exitCount * sizeof(int32_t) + frame->stringsSize)
+        return nullptr;
+
+    return frame;
+}
+
+// Replays the frames from the nearest keyframe up to the last frame
+// recorded at or before atMs, or up to the newest frame.
+static int loadRecording(const char *data, size_t size)
+{
+    const RecHeader *hdr = (const RecHeader *)data;
+
+    if (size < sizeof(RecHeader) || hdr->version != REC_VERSION || hdr->headerSize != sizeof(RecHeader) ||
+        hdr->recordSize != sizeof(SnapRecord))
+        return printErr("Unsupported recording version " + to_string(hdr->version) + ": " + loadFile);
+
+    if (rssMem != bool(hdr->flags & SNAP_RSS))
+        return printErr((rssMem ? "Not recorded with --rss: " : "Recorded with --rss: ") + (string)loadFile);
+
+    if (totalIo != bool(hdr->flags & SNAP_TOTAL_IO))
+        return printErr((totalIo ? "Not recorded with --total-io: " : "Recorded with --total-io: ") + (string)loadFile);
+
+    const char *ring = data + sizeof(RecHeader);
+    uint64_t ringSize = min(hdr->capacity, size - sizeof(RecHeader)), pos = hdr->head;
+
+    vector<const FrameHeader *> frames;
+
+    // The ring cannot hold more frames than headers. If the count is still
+    // wrong, the walk comes back around to the first frame.
+    if (hdr->frameCount > ringSize / sizeof(FrameHeader))
+        return printErr("Corrupt recording: " + (string)loadFile);
+
+    uint64_t firstPos = 0;
+
+    for (uint64_t i = 0; i < hdr->frameCount; i++)
+    {
+        const FrameHeader *frame = getFrame(ring, ringSize, hdr->capacity, pos);
+
+        if (!frame || (frames.empty() && frame->type != FRAME_KEY) || (i && pos == firstPos))
+            return printErr("Corrupt recording: " + (string)loadFile);
+
+        if (!i)
+            firstPos = pos;
+
+        frames.push_back(frame);
+        pos += frame->size;
+    }
+
+    if (frames.empty())
+        return printErr("Empty recording: " + (string)loadFile);
+
+    size_t last = frames.size() - 1;
+
+    if (atMs >= 0)
+    {
+        while (last && frames[last]->time > atMs)
+            last--;
+
+        if (frames[last]->time > atMs)
+            return printErr("Nothing recorded at " + formatTime(atMs) + ", the oldest frame is at " +
+                            formatTime(frames[0]->time));
+    }
+
+    size_t first = last;
+    while (frames[first]->type != FRAME_KEY)
+        first--;
+
+    // In the recorded order, like a rescan would have them. The exited ones are marked failed.
+    vector<Proc> procs;
+    unordered_map<pid_t, size_t> rows;
+
+    for (size_t i = first; i <= last; i++)
+    {
+        const FrameHeader *frame = frames[i];
+        const SnapRecord *records = (const SnapRecord *)(frame + 1);
+        const int32_t *exited = (const int32_t *)(records + frame->recordCount);
+        const char *strings = (const char *)(exited + frame->exitCount);
+
+        for (uint32_t j = 0; j < frame->recordCount; j++)
+        {
+            Proc proc;
+
+            if (!readSnapRecord(records[j], strings, frame->stringsSize, proc))
+                return printErr("Corrupt recording: " + (string)loadFile);
+
+            auto it = rows.find(proc.pid);
+
+            if (it != rows.end() && !procs[it->second].failed)
+                procs[it->second] = move(proc);
+            else
+            {
+                rows[proc.pid] = procs.size();
+                procs.push_back(move(proc));
+            }
+        }
+
+        for (uint32_t j = 0; j < frame->exitCount; j++)
+        {
+            auto it = rows.find(exited[j]);
+
+            if (it != rows.end())
+                procs[it->second].failed = true;
+        }
+    }
+
+    if (verbose)
+        cerr << "Frame recorded at " << formatTime(frames[last]->time) << endl;
+
+    for (Proc &proc : procs)
+    {
+        if (proc.failed)
+            continue;
+
+        // Records keep their age from the frame they were last changed in.
+        if (hdr->clkTck)
+            proc.age = 1000 * frames[last]->uptime - 1000 * proc.startTime / hdr->clkTck;
+
+        if (skipKernel && (proc.pid == 2 || proc.ppid == 2))
+            skippedKernelProc.insert(proc.pid);
+        else
+            procTable.push_back(move(proc));
+    }
+
+    return indexProcs();
+}
+
+static int loadSnapshot()
+{
+    int fd = open(loadFile, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return printErrCode("Failed to open " + (string)loadFile);
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        close(fd);
+        return printErrCode("Failed to read " + (string)loadFile);
+    }
+
+    size_t size = st.st_size;
+    void *map = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return size ? printErrCode("Failed to read " + (string)loadFile) : printErr("Empty snapshot: " + (string)loadFile);
+
+    const char *data = (const char *)map;
+    const SnapHeader *hdr = (const SnapHeader *)data;
+
+    auto badSnapshot = [&](string msg) -> int
+    {
+        munmap(map, size);
+        return printErr(msg + ": " + loadFile);
+    };
+
+    if (size >= sizeof(RecHeader) && !memcmp(hdr->magic, REC_MAGIC, sizeof(hdr->magic)))
+    {
+        int res = loadRecording(data, size);
+        munmap(map, size);
+        return res;
+    }
+
+    if (size < sizeof(SnapHeader) || memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)))
+        return badSnapshot("Not a snapshot");
+
+    if (atMs >= 0)
+        return badSnapshot("--at requires a recording");
+
+    if (hdr->version != SNAP_VERSION || hdr->headerSize != sizeof(SnapHeader) || hdr->recordSize != sizeof(SnapRecord))
+        return badSnapshot("Unsupported snapshot version " + to_string(hdr->version));
+
+    if (hdr->recordCount > (size - sizeof(SnapHeader)) / sizeof(SnapRecord) ||
+        hdr->stringsSize != size - sizeof(SnapHeader) - hdr->recordCount * sizeof(SnapRecord))
+        return badSnapshot("Truncated snapshot");
+
+    if (rssMem != bool(hdr->flags & SNAP_RSS))
+        return badSnapshot(rssMem ? "Snapshot not saved with --rss" : "Snapshot saved with --rss");
+
+    if (totalIo != bool(hdr->flags & SNAP_TOTAL_IO))
+        return badSnapshot(totalIo ? "Snapshot not saved with --total-io" : "Snapshot saved with --total-io");
+
+    const SnapRecord *records = (const SnapRecord *)(data + sizeof(SnapHeader));
+    const char *strings = (const char *)(records + hdr->recordCount);
+
+    for (uint64_t i = 0; i < hdr->recordCount; i++)
+    {
+        Proc proc;
+
+        if (!readSnapRecord(records[i], strings, hdr->stringsSize, proc))
+            return badSnapshot("Corrupt snapshot");
+
+        // Saved with --kernel.
+        if (skipKernel && (proc.pid == 2 || proc.ppid == 2))
+        {
+            if (!proc.tid)
+                skippedKernelProc.insert(proc.pid);
+        }
+        else if (proc.tid)
+        {
+            // Records of the threads follow their process.
+            if (!skipThreads && !procTable.empty() && procTable.back().pid == proc.pid)
+                procTable.back().threads.push_back(move(proc));
+        }
+        else
+            procTable.push_back(move(proc));
+    }
+
+    munmap(map, size);
+    return indexProcs();
+}
+
+/////////////////////////////////////////////////////////////////////////
+
+// https://www.kernel.org/doc/html/latest/driver-api/connector.html
+// Netlink proc connector: the kernel multicasts an event on every fork,
+// exec, exit etc. Receiving them requires CAP_NET_ADMIN.
+static int openProcEvents()
+{
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Make room for process storms between the frames.
+    int size = 8 << 20;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] = {};
+
+    struct nlmsghdr *nl = (struct nlmsghdr *)buf;
+    nl->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    nl->nlmsg_type = NLMSG_DONE;
+
+    struct cn_msg *cn = (struct cn_msg *)NLMSG_DATA(nl);
+    cn->id.idx = CN_IDX_PROC;
+    cn->id.val = CN_VAL_PROC;
+    cn->len = sizeof(enum proc_cn_mcast_op);
+
+    enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+    memcpy(cn->data, &op, sizeof(op));
+
+    if (send(fd, buf, nl->nlmsg_len, 0) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+enum ProcEvent
+{
+    EV_NEW,
+    EV_CHANGED,
+    EV_EXITED
+};
+
+// Returns false if events were lost (receive buffer overflow).
+static bool readProcEvents(int fd, map<pid_t, ProcEvent> &events)
+{
+    char buf[1 << 16];
+    ssize_t len;
+
+    while ((len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    {
+        for (struct nlmsghdr *nl = (struct nlmsghdr *)buf; NLMSG_OK(nl, len); nl = NLMSG_NEXT(nl, len))
+        {
+            if (nl->nlmsg_type == NLMSG_ERROR || nl->nlmsg_type == NLMSG_NOOP)
+                continue;
+
+            struct cn_msg *cn = (struct cn_msg *)NLMSG_DATA(nl);
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+                continue;
+
+            struct proc_event *ev = (struct proc_event *)cn->data;
+
+            // Threads are not in the tree.
+            switch (ev->what)
+            {
+            case proc_event::PROC_EVENT_FORK:
+                if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid)
+                    events[ev->event_data.fork.child_tgid] = EV_NEW;
+                break;
+            case proc_event::PROC_EVENT_EXEC:
+            case proc_event::PROC_EVENT_UID:
+            case proc_event::PROC_EVENT_SID:
+            case proc_event::PROC_EVENT_COMM:
+            {
+                // All of these begin with process_pid and process_tgid.
+                pid_t tgid = ev->event_data.exec.process_tgid;
+                if (events.find(tgid) == events.end())
+                    events[tgid] = EV_CHANGED;
+                break;
+            }
+            case proc_event::PROC_EVENT_EXIT:
+                if (ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid)
+                    events[ev->event_data.exit.process_tgid] = EV_EXITED;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    return len >= 0 || errno != ENOBUFS;
+}
+
+// Applies the received events instead of walking /proc. Only the new and
+// changed processes, and the children of the exited ones (reparented) are
+// read. All the others are re-sampled only if their volatile fields are
+// shown, or if it's time to refresh the slow ones.
+static int applyProcEvents(int fd, bool slow)
+{
+    map<pid_t, ProcEvent> events;
+
+    if (!readProcEvents(fd, events))
+    {
+        if (verbose)
+            printErr("Lost proc events, rescanning");
+        return refreshProcs(slow);
+    }
+
+    errMap.clear();
+
+    if (updateUptime())
+        return 1;
+
+    vector<char> toSample(procTable.size());
+
+    for (auto &pair : events)
+    {
+        pid_t pid = pair.first;
+        int row = findRow(pid);
+
+        if (pair.second == EV_EXITED)
+        {
+            if (row >= 0)
+            {
+                for (int i = childStart[row]; i < childStart[row + 1]; i++)
+                    toSample[childRows[i]] = true;
+            }
+
+            if (Proc *proc = findProc(pid))
+                proc->failed = true;
+        }
+        else if (findProc(pid))
+            toSample[row] = true;
+
+        if (pair.second != EV_CHANGED)
+            skippedKernelProc.erase(pid);
+    }
+
+    bool all = slow || show_col_cpu || show_col_rio || show_col_wio || show_col_flt;
+
+    vector<pair<int, bool>> rows;
+
+    for (size_t i = 0; i < procTable.size(); i++)
+    {
+        if (procTable[i].failed)
+            continue;
+
+        if (toSample[i])
+            rows.push_back({i, true});
+        else if (all)
+            rows.push_back({i, slow});
+    }
+
+    if (sampleProcs(rows))
+        return 1;
+
+    // New pids, and the ones which failed the starttime check (a fork
+    // received before the initial scan, then the pid reused) are created.
+    vector<pid_t> newPids;
+
+    for (auto &pair : events)
+    {
+        if (pair.second != EV_EXITED && !findProc(pair.first) &&
+            skippedKernelProc.find(pair.first) == skippedKernelProc.end())
+            newPids.push_back(pair.first);
+    }
+
+    return addNewProcs(newPids);
+}
+
+static void matchCmds(set<pid_t> &pidList)
+{
+    if (cmdPatterns.empty())
+        return;
+
+    pid_t myPid = getpid();
+    vector<char> hits(cmdPatterns.size());
+
+    for (Proc &proc : procTable)
+    {
+        if (proc.pid == myPid)
+            continue;
+
+        // Already checked in the scan, except for the loaded processes.
+        // All the patterns are checked for the messages with verbose.
+        bool matched;
+
+        if (verbose)
+            matched = matchCmdline(proc.cmdline, &hits);
+        else if (proc.cmdMatch < 0)
+            matched = matchCmdline(proc.cmdline);
+        else
+            matched = proc.cmdMatch;
+
+        if (matched)
+            pidList.insert(proc.pid);
+    }
+
+    for (size_t i = 0; i < cmdPatterns.size() && verbose; i++)
+    {
+        if (!hits[i])
+            printErr("No match for process name: " + cmdPatterns[i]);
+    }
+}
+
+static int parseArgs(char **args, int size, set<pid_t> &pidList)
+{
+    for (int i = 0; i < size; i++)
+    {
+        string str = args[i];
+
+        if (!noPid && isNumber(str, "pid", false))
+        {
+            pid_t pid = stoi(str);
+            if (findProc(pid))
+                pidList.insert(pid);
+            else if (verbose)
+            {
+                if (skipKernel && skippedKernelProc.find(pid) != skippedKernelProc.end())
+                    printErr((string) "Ignoring pid " + str);
+                else if (errMap.find(pid) != errMap.end())
+                    printErr((string) "Pid " + str + ": " + errMap[pid]);
+                else
+                    printErr((string) "Pid " + str + " not found");
+            }
+        }
+    }
+
+    matchCmds(pidList);
+
+    if (pidList.empty())
+        return verbose ? 1 : printErr("Nothing matched");
+
+    return 0;
+}
+
+static auto constexpr MB = 1000000.0;
+static auto constexpr GB = 1000000000.0;
+
+static string toFixed(double val, int precision, const char *suffix)
+{
+    char buf[32];
+    char *end = to_chars(buf, buf + sizeof(buf), val, chars_format::fixed, precision).ptr;
+    return string(buf, end) + suffix;
+}
+
+static string toReadableSize(long bytes)
+{
+    if (bytes < MB)
+        return to_string(bytes / 1000) + " KB";
+
+    if (bytes < GB)
+        return toFixed(bytes / MB, 1, " MB");
+    else
+        return toFixed(bytes / GB, 1, " GB");
+}
+
+static string toReadableTime(long sec)
+{
+    int d, h, m;
+
+    d = sec / (60 * 60 * 24);
+    sec -= d * (60 * 60 * 24);
+
+    h = sec / (60 * 60);
+    sec -= h * (60 * 60);
+
+    m = sec / 60;
+    sec -= m * 60;
+
+    if (d > 0)
+        return to_string(d) + "d" + (h > 0 ? to_string(h) + "h" : "");
+
+    if (h > 0)
+        return to_string(h) + "h" + (m > 0 ? to_string(m) + "m" : "");
+
+    if (m > 0)
+        return to_string(m) + "m" + (sec > 0 ? to_string(sec) + "s" : "");
+
+    return to_string(sec) + "s";
+}
+
+static string toPercentage(long dividend, long divisor)
+{
+    return toFixed(100 * dividend / (float)divisor, 2, "%");
+}
+
+static string toRate(long long delta, long ms, bool size)
+{
+    long long rate = delta * 1000 / ms;
+    return size ? toReadableSize(rate) + "/s" : to_string(rate);
+}
+
+// Returns the length in bytes of the longest prefix of s which fits in
+// cols columns, taking one column for every UTF-8 encoded code point.
+static size_t fitColumns(const string &s, size_t cols)
+{
+    size_t len = s.length();
+
+    // Fast path: ASCII only up to cols.
+    size_t i = 0, n = min(len, cols);
+    while (i < n && !(s[i] & 0x80))
+        i++;
+
+    if (i == n)
+        return n;
+
+    // Continuation bytes (10xxxxxx) do not start a new code point.
+    for (size_t col = i; i < len; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80 && col++ == cols)
+            break;
+    }
+
+    return i;
+}
+
+// Each line is built here, and then appended to the output buffer.
+static string line;
+
+static void putCol(string_view s, int width, bool leftAlign = false)
+{
+    if (!leftAlign && (int)s.length() < width)
+        line.append(width - s.length(), ' ');
+
+    line += s;
+
+    if (leftAlign && (int)s.length() < width)
+        line.append(width - s.length(), ' ');
+}
+
+static void putCol(long long num, int width)
+{
+    char buf[24];
+    char *end = to_chars(buf, buf + sizeof(buf), num).ptr;
+    putCol(string_view(buf, end - buf), width);
+}
+
+// --cumulative: adds up the columns over every subtree in one pass. Rows
+// are ordered breadth first from the parents which are not in the table,
+// so that in the reverse order all children come before their parent.
+static void sumSubtrees()
+{
+    long long start = monotonicNs();
+    size_t count = procTable.size();
+
+    vector<int> order;
+    order.reserve(count);
+
+    for (size_t row = count; row < rowPids.size(); row++)
+        order.insert(order.end(), childRows.begin() + childStart[row], childRows.begin() + childStart[row + 1]);
+
+    for (size_t i = 0; i < order.size(); i++)
+        order.insert(order.end(), childRows.begin() + childStart[order[i]], childRows.begin() + childStart[order[i] + 1]);
+
+    // Unknown values are left out, and the sum is unknown only if all are.
+    auto add = [](auto &sum, auto val)
+    {
+        if (val >= 0)
+            sum = sum < 0 ? val : sum + val;
+    };
+
+    for (Proc &proc : procTable)
+    {
+        bool kernel = proc.pid == 2 || proc.ppid == 2;
+
+        proc.subPss = kernel ? -1 : proc.pss;
+        proc.subSwapPss = kernel ? -1 : proc.swapPss;
+        proc.subCpuTime = proc.cpuTime;
+        proc.subReadIO = proc.readIO;
+        proc.subWriteIO = proc.writeIO;
+
+        // The ones not seen in both samples have no deltas.
+        bool noRate = sampled && proc.sampleMs < 0;
+        proc.subCpuDelta = noRate ? 0 : proc.cpuDelta;
+        proc.subReadDelta = noRate ? 0 : proc.readDelta;
+        proc.subWriteDelta = noRate ? 0 : proc.writeDelta;
+    }
+
+    for (size_t i = order.size(); i-- > 0;)
+    {
+        const Proc &child = procTable[order[i]];
+        int row = findRow(child.ppid);
+
+        if (row < 0 || (size_t)row >= count)
+            continue;
+
+        Proc &parent = procTable[row];
+
+        add(parent.subPss, child.subPss);
+        add(parent.subSwapPss, child.subSwapPss);
+        add(parent.subCpuTime, child.subCpuTime);
+        add(parent.subReadIO, child.subReadIO);
+        add(parent.subWriteIO, child.subWriteIO);
+
+        parent.subCpuDelta += child.subCpuDelta;
+        parent.subReadDelta += child.subReadDelta;
+        parent.subWriteDelta += child.subWriteDelta;
+    }
+
+    treeNs += monotonicNs() - start;
+}
+
+// The process with its columns replaced by the subtree sums.
+// The summable columns of a row: of the process, or of its subtree.
+struct ShownValues
+{
+    long pss, swapPss;
+    long cpuTime, cpuDelta;
+    long long readIO, writeIO, readDelta, writeDelta;
+};
+
+static ShownValues shownValues(const Proc &proc)
+{
+    // Threads are not summed up.
+    if (cumulative && !proc.tid)
+        return {proc.subPss, proc.subSwapPss, proc.subCpuTime, proc.subCpuDelta,
+                proc.subReadIO, proc.subWriteIO, proc.subReadDelta, proc.subWriteDelta};
+
+    return {proc.pss, proc.swapPss, proc.cpuTime, proc.cpuDelta, proc.readIO, proc.writeIO, proc.readDelta, proc.writeDelta};
+}
+
+// --format fields: separated, and named in JSON.
+static bool firstField;
+
+static void putFieldName(string_view name)
+{
+    if (!firstField)
+        line += outFormat == FORMAT_TSV ? '\t' : ',';
+
+    firstField = false;
+
+    if (outFormat == FORMAT_JSONL)
+    {
+        line += '"';
+        line += name;
+        line += "\":";
+    }
+}
+
+// Negative values are unknown: null in JSON, empty in CSV and TSV.
+static void putField(string_view name, long long num)
+{
+    putFieldName(name);
+
+    if (num >= 0)
+    {
+        char buf[24];
+        line.append(buf, to_chars(buf, buf + sizeof(buf), num).ptr);
+    }
+    else if (outFormat == FORMAT_JSONL)
+        line += "null";
+}
+
+// Length of the valid UTF-8 sequence at str[i], 0 if invalid (stray
+// continuation byte, truncated, overlong, surrogate or beyond U+10FFFF).
+static size_t utf8Length(string_view str, size_t i)
+{
+    unsigned char c = str[i];
+
+    if (c < 0x80)
+        return 1;
+
+    size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 0;
+
+    if (!len || c > 0xF4 || i + len > str.length())
+        return 0;
+
+    uint32_t cp = c & (0x7F >> len);
+
+    for (size_t j = 1; j < len; j++)
+    {
+        unsigned char next = str[i + j];
+
+        if ((next & 0xC0) != 0x80)
+            return 0;
+
+        cp = cp << 6 | (next & 0x3F);
+    }
+
+    static constexpr uint32_t MIN_CP[] = {0, 0, 0x80, 0x800, 0x10000};
+
+    if (cp < MIN_CP[len] || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        return 0;
+
+    return len;
+}
+
+static void putField(string_view name, string_view str)
+{
+    putFieldName(name);
+
+    if (outFormat == FORMAT_JSONL)
+    {
+        line += '"';
+
+        // Cmdlines are arbitrary bytes, but JSON must be valid UTF-8.
+        for (size_t i = 0; i < str.length();)
+        {
+            unsigned char c = str[i];
+            size_t len = utf8Length(str, i);
+
+            if (c == '"' || c == '\\')
+            {
+                line += '\\';
+                line += c;
+            }
+            else if (c < 0x20 || c == 0x7F)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                line += buf;
+            }
+            else if (!len)
+                line += "\\ufffd";
+            else
+                line.append(str, i, len);
+
+            i += max(len, (size_t)1);
+        }
+
+        line += '"';
+    }
+    else if (outFormat == FORMAT_CSV)
+    {
+        if (str.find_first_of(",\"\r\n") == string_view::npos)
+        {
+            line += str;
+            return;
+        }
+
+        line += '"';
+
+        for (char c : str)
+        {
+            if (c == '"')
+                line += '"';
+            line += c;
+        }
+
+        line += '"';
+    }
+    else
+    {
+        for (char c : str)
+        {
+            if (c == '\t')
+                line += "\\t";
+            else if (c == '\n')
+                line += "\\n";
+            else if (c == '\r')
+                line += "\\r";
+            else if (c == '\\')
+                line += "\\\\";
+            else
+                line += c;
+        }
+    }
+}
+
+// A --format record with the raw values, or the CSV / TSV header if proc
+// is nullptr. With --interval, cpu, io and flt are the change over sample_ms.
+static void printRecord(const Proc *proc, int depth)
+{
+    static const Proc none{};
+    const Proc &p = proc ? *proc : none;
+
+    line.clear();
+    firstField = true;
+
+    auto num = [&](bool show, string_view name, long long val)
+    {
+        if (show)
+            proc ? putField(name, val) : putField(name, name);
+    };
+
+    auto str = [&](bool show, string_view name, string_view val)
+    {
+        if (show)
+            putField(name, proc ? val : name);
+    };
+
+    bool kernel = p.pid == 2 || p.ppid == 2;
+    bool noRate = sampled && p.sampleMs < 0;
+
+    if (outFormat == FORMAT_JSONL)
+        line += '{';
+
+    num(show_col_ppid, "ppid", p.ppid);
+    num(show_col_pgid, "pgid", p.pgid);
+    num(show_col_sid, "sid", p.sid);
+    num(show_col_pid, "pid", p.pid);
+    num(!skipThreads, "tid", p.tid ? p.tid : -1);
+
+    if (show_col_tty && p.tid)
+        num(true, "tty", -1);
+    else
+        str(show_col_tty, "tty", p.tty);
+
+    num(show_col_uid, "uid", p.uid == (uid_t)-1 ? -1 : p.uid);
+    str(show_col_uid && !noName, "user", proc ? getUserName(p.uid) : "");
+    num(show_col_ram, "ram_bytes", p.tid || kernel ? -1 : p.pss);
+    num(show_col_swap, "swap_bytes", p.tid || kernel ? -1 : p.swapPss);
+    num(show_col_cpu, "cpu_ms", noRate ? -1 : (sampled ? p.cpuDelta : p.cpuTime));
+    num(show_col_age, "age_ms", p.age);
+    num(show_col_rio, "read_bytes", noRate ? -1 : (sampled ? p.readDelta : p.readIO));
+    num(show_col_wio, "write_bytes", noRate ? -1 : (sampled ? p.writeDelta : p.writeIO));
+    num(show_col_flt, "min_flt", noRate ? -1 : (sampled ? p.minFltDelta : p.minFlt));
+    num(show_col_flt, "maj_flt", noRate ? -1 : (sampled ? p.majFltDelta : p.majFlt));
+    num(sampled, "sample_ms", noRate ? -1 : p.sampleMs);
+
+    // Subtree sums, of the same values as the fields above.
+    bool sum = cumulative && !p.tid && !noRate;
+    num(cumulative && show_col_ram, "tree_ram_bytes", sum ? p.subPss : -1);
+    num(cumulative && show_col_swap, "tree_swap_bytes", sum ? p.subSwapPss : -1);
+    num(cumulative && show_col_cpu, "tree_cpu_ms", sum ? (sampled ? p.subCpuDelta : p.subCpuTime) : -1);
+    num(cumulative && show_col_rio, "tree_read_bytes", sum ? (sampled ? p.subReadDelta : p.subReadIO) : -1);
+    num(cumulative && show_col_wio, "tree_write_bytes", sum ? (sampled ? p.subWriteDelta : p.subWriteIO) : -1);
+
+    num(true, "depth", depth);
+    str(show_col_cmd, "cmd", p.cmdline);
+
+    if (outFormat == FORMAT_JSONL)
+        line += '}';
+
+    line += '\n';
+    putOut(line);
+}
+
+static void printProc(const Proc &proc, const string &prefix)
+{
+    const ShownValues vals = shownValues(proc);
+
+    line.clear();
+
+    if (show_col_ppid)
+        putCol(proc.ppid, col_wid_pid);
+    if (show_col_pgid)
+        putCol(proc.pgid, col_wid_pid);
+    if (show_col_sid)
+        putCol(proc.sid, col_wid_pid);
+    if (show_col_pid)
+        putCol(proc.pid, col_wid_pid);
+    if (!skipThreads)
+    {
+        if (proc.tid)
+            putCol(proc.tid, col_wid_pid);
+        else
+            putCol("-", col_wid_pid);
+    }
+    if (show_col_tty)
+        putCol(proc.tid ? DASH : proc.tty, col_wid_tty);
+    if (show_col_uid)
+    {
+        line += "  ";
+        string_view user = getUserName(proc.uid);
+
+        if ((int)user.length() > col_wid_uid - 2)
+            putCol(string(user.substr(0, col_wid_uid - 3)) + "+", col_wid_uid, true);
+        else
+            putCol(user, col_wid_uid, true);
+    }
+    // Kernel threads have no memory. Neither has a subtree of them.
+    bool noMem = proc.tid || (cumulative ? vals.pss < 0 : proc.pid == 2 || proc.ppid == 2);
+
+    if (show_col_ram)
+        putCol(noMem ? "-" : toReadableSize(vals.pss), col_wid_ram);
+    if (show_col_swap)
+        putCol(noMem ? "-" : toReadableSize(vals.swapPss), col_wid_swap);
+    // Threads and processes not seen in both samples have no rates.
+    bool noRate = sampled && proc.sampleMs < 0;
+
+    if (show_col_cpu)
+    {
+        if (cpuTime)
+            putCol(toReadableTime(vals.cpuTime / 1000), col_wid_cpu);
+        else if (noRate)
+            putCol("-", col_wid_cpu);
+        else if (sampled)
+            putCol(toPercentage(vals.cpuDelta, proc.sampleMs), col_wid_cpu);
+        else
+            putCol(toPercentage(vals.cpuTime, proc.age), col_wid_cpu);
+    }
+    if (show_col_age)
+        putCol(toReadableTime(proc.age / 1000), col_wid_age);
+    if (show_col_rio)
+        putCol(noRate ? "-" : (sampled ? toRate(vals.readDelta, proc.sampleMs, true) : toReadableSize(vals.readIO)), col_wid_rio);
+    if (show_col_wio)
+        putCol(noRate ? "-" : (sampled ? toRate(vals.writeDelta, proc.sampleMs, true) : toReadableSize(vals.writeIO)), col_wid_wio);
+    if (show_col_flt)
+    {
+        if (noRate)
+        {
+            putCol("-", col_wid_flt);
+            putCol("-", col_wid_flt);
+        }
+        else if (sampled)
+        {
+            putCol(toRate(proc.minFltDelta, proc.sampleMs, false), col_wid_flt);
+            putCol(toRate(proc.majFltDelta, proc.sampleMs, false), col_wid_flt);
+        }
+        else
+        {
+            putCol(proc.minFlt, col_wid_flt);
+            putCol(proc.majFlt, col_wid_flt);
+        }
+    }
+    if (show_col_cmd)
+    {
+        line += "  ";
+        line += prefix;
+        line += proc.cmdline;
+    }
+
+    // Not truncated if the output is not a terminal.
+    if (!noTrunc && TERM_COLS >= 0)
+        line.resize(fitColumns(line, TERM_COLS));
+
+    line += '\n';
+    putOut(line);
+}
+
+struct TreeEntry
+{
+    unsigned int siblingCount, curSibling;
+};
+
+// Indexed by row. The tree is kept intact for the next frame in watch mode.
+static vector<char> printedProcs, printedChildren;
+
+// Rows selected with --top and their ancestors. All rows are shown if empty.
+static vector<char> shownRows;
+
+static bool isShown(int row)
+{
+    return shownRows.empty() || shownRows[row];
+}
+
+static void printPidTree(int row, vector<TreeEntry> &tree)
+{
+    // PID 0 is not a real parent. Or in case if PIDs from the table
+    // are already consumed being child of a previously printed PID.
+    bool hasParent = (size_t)row < procTable.size() && !printedProcs[row] && isShown(row);
+
+    unsigned int childCount = 0;
+
+    if (!noTree && !printedChildren[row])
+    {
+        if (shownRows.empty())
+            childCount = childStart[row + 1] - childStart[row];
+        else
+        {
+            for (int i = childStart[row]; i < childStart[row + 1]; i++)
+                childCount += shownRows[childRows[i]];
+        }
+    }
+
+    bool hasChildren = childCount > 0;
+
+    // No tree art, only the depth.
+    bool text = outFormat == FORMAT_TEXT;
+
+    if (hasParent)
+    {
+        string prefix = "", tidPrefix = "";
+        int iter = 1, size = text ? tree.size() : 0;
+        bool last;
+
+        for (struct TreeEntry &te : tree)
+        {
+            if (!text)
+                break;
+
+            last = te.siblingCount == te.curSibling;
+            if (iter++ == size)
+            {
+                prefix += last ? ART_UP_RIGHT : ART_VERT_RIGHT;
+                prefix += ART_HORIZ;
+                prefix += hasChildren ? ART_DOWN_HORIZ : ART_HORIZ;
+                prefix += ART_HORIZ_LEFT;
+
+                tidPrefix += last ? " " : ART_VERT;
+                tidPrefix += " ";
+                tidPrefix += hasChildren ? ART_VERT : " ";
+                tidPrefix += " ";
+            }
+            else
+            {
+                prefix += (last ? " " : ART_VERT) + " ";
+                tidPrefix += (last ? " " : ART_VERT) + " ";
+            }
+        }
+
+        const Proc &proc = procTable[row];
+
+        if (text)
+            printProc(proc, prefix);
+        else
+            printRecord(&proc, tree.size());
+
+        printedProcs[row] = true;
+
+        if (hasThreadRows(proc))
+        {
+            int i = 0, size = proc.threads.size();
+            string threadPrefix;
+
+            for (const Proc &thread : proc.threads)
+            {
+                if (!text)
+                {
+                    printRecord(&thread, tree.size() + 1);
+                    continue;
+                }
+
+                threadPrefix = tidPrefix;
+
+                if (++i == size)
+                    threadPrefix += hasChildren && tree.empty() ? ART_VERT_RIGHT : ART_UP_RIGHT;
+                else
+                    threadPrefix += ART_VERT_RIGHT;
+
+                threadPrefix += ART_HORIZ_LEFT;
+
+                printProc(thread, threadPrefix);
+            }
+        }
+    }
+
+    if (!hasChildren)
+        return;
+
+    printedChildren[row] = true;
+
+    if (hasParent)
+        tree.push_back({.siblingCount = childCount, .curSibling = 1});
+
+    for (int i = childStart[row]; i < childStart[row + 1]; i++)
+    {
+        if (!isShown(childRows[i]))
+            continue;
+
+        printPidTree(childRows[i], tree);
+        if (hasParent)
+            tree.back().curSibling++;
+    }
+
+    if (hasParent)
+        tree.pop_back();
+}
+
+// Value of the --sort column, as it is printed. -1 if unknown.
+static double sortValue(const Proc &proc)
+{
+    bool noRate = sampled && proc.sampleMs < 0;
+
+    // Subtree sums with --cumulative.
+    bool sum = cumulative && !proc.tid;
+    long cpu = sum ? proc.subCpuTime : proc.cpuTime, cpuDelta = sum ? proc.subCpuDelta : proc.cpuDelta;
+    long long readIO = sum ? proc.subReadIO : proc.readIO, writeIO = sum ? proc.subWriteIO : proc.writeIO;
+    long long ioDelta = sum ? proc.subReadDelta + proc.subWriteDelta : proc.readDelta + proc.writeDelta;
+
+    switch (sortKey)
+    {
+    case SORT_RAM:
+        return sum ? proc.subPss : proc.pss;
+    case SORT_SWAP:
+        return sum ? proc.subSwapPss : proc.swapPss;
+    case SORT_CPU:
+        if (cpuTime)
+            return cpu;
+        if (noRate)
+            return -1;
+        return sampled ? (double)cpuDelta / proc.sampleMs : (double)cpu / max(proc.age, 1L);
+    case SORT_AGE:
+        return proc.age;
+    case SORT_IO:
+        if (noRate || readIO < 0 || writeIO < 0)
+            return -1;
+        return sampled ? (double)ioDelta / proc.sampleMs : readIO + writeIO;
+    case SORT_FLT:
+        if (noRate || proc.minFlt < 0 || proc.majFlt < 0)
+            return -1;
+        return sampled ? (double)(proc.minFltDelta + proc.majFltDelta) / proc.sampleMs : proc.minFlt + proc.majFlt;
+    default:
+        return 0;
+    }
+}
+
+// Returns true if a is printed before b. Ties are in pid order.
+static bool sortsBefore(const Proc &a, const Proc &b)
+{
+    if (sortKey == SORT_CMD)
+    {
+        int res = a.cmdline.view().compare(b.cmdline.view());
+        if (res)
+            return res < 0;
+    }
+    else if (sortKey == SORT_UID)
+    {
+        if (a.uid != b.uid)
+            return a.uid < b.uid;
+    }
+    else if (sortKey != SORT_PID)
+    {
+        double va = sortValue(a), vb = sortValue(b);
+        if (va != vb)
+            return va > vb;
+    }
+
+    return a.pid < b.pid;
+}
+
+static bool rowSortsBefore(int a, int b)
+{
+    return sortsBefore(procTable[a], procTable[b]);
+}
+
+// --top: keeps the topCount processes which sort first among the given
+// rows. In a lazy scan the rows are loaded only as far as required: with
+// --sort ram the resident size from statm is an upper bound of PSS (and
+// equal to RSS), so the ones which cannot beat the current top N are not
+// read at all. Failed rows are left in the table.
+static vector<int> selectTop(vector<int> &rows)
+{
+    size_t count = min((size_t)topCount, rows.size());
+    vector<int> top;
+
+    auto loadSome = [&](vector<int> &batch)
+    {
+        if (lazyLoad)
+            loadRows(batch);
+    };
+
+    if (lazyLoad && sortKey == SORT_RAM)
+    {
+        vector<long> bounds(procTable.size());
+        long long start = monotonicNs();
+
+        runJobs(rows.size(), [&](size_t i, ScanBuffer &)
+                {
+                    long rss = getStatmRss(procTable[rows[i]]);
+                    bounds[rows[i]] = rss < 0 ? LONG_MAX : rss; });
+
+        scanNs += monotonicNs() - start;
+
+        auto smallerBound = [&](int a, int b)
+        {
+            return bounds[a] < bounds[b];
+        };
+
+        // The biggest bound first. The top N is a heap with the last one first.
+        make_heap(rows.begin(), rows.end(), smallerBound);
+
+        size_t left = rows.size();
+        vector<int> batch;
+
+        while (left)
+        {
+            if (top.size() == count && bounds[rows[0]] < procTable[top[0]].pss)
+                break;
+
+            batch.clear();
+
+            while (left && batch.size() < max(count, (size_t)jobs))
+            {
+                pop_heap(rows.begin(), rows.begin() + left, smallerBound);
+                batch.push_back(rows[--left]);
+            }
+
+            loadSome(batch);
+
+            for (int row : batch)
+            {
+                if (procTable[row].failed)
+                    continue;
+
+                top.push_back(row);
+                push_heap(top.begin(), top.end(), rowSortsBefore);
+
+                if (top.size() > count)
+                {
+                    pop_heap(top.begin(), top.end(), rowSortsBefore);
+                    top.pop_back();
+                }
+            }
+        }
+
+        sort(top.begin(), top.end(), rowSortsBefore);
+        return top;
+    }
+
+    // The other columns are either read in the first phase, or for all.
+    if (sortKey == SORT_UID || sortKey == SORT_RAM || sortKey == SORT_SWAP || sortKey == SORT_IO)
+        loadSome(rows);
+
+    for (int row : rows)
+    {
+        if (!procTable[row].failed)
+            top.push_back(row);
+    }
+
+    count = min(count, top.size());
+    partial_sort(top.begin(), top.begin() + count, top.end(), rowSortsBefore);
+    top.resize(count);
+
+    return top;
+}
+
+static void printHeader()
+{
+    if (noHeader || outFormat == FORMAT_JSONL)
+        return;
+
+    if (outFormat != FORMAT_TEXT)
+        return printRecord(nullptr, 0);
+
+    line.clear();
+
+    auto printHdr = [](bool show, string_view title, int width, bool leftAlign)
+    {
+        if (show)
+        {
+            if (leftAlign)
+                line += "  ";
+
+            putCol(title, width, leftAlign);
+        }
+    };
+
+    printHdr(show_col_ppid, "PPID", col_wid_pid, false);
+    printHdr(show_col_pgid, "PGID", col_wid_pid, false);
+    printHdr(show_col_sid, "SID", col_wid_pid, false);
+    printHdr(show_col_pid, "PID", col_wid_pid, false);
+    printHdr(!skipThreads, "TID", col_wid_pid, false);
+    printHdr(show_col_tty, "TTY", col_wid_tty, false);
+    printHdr(show_col_uid, "UID", col_wid_uid, true);
+    printHdr(show_col_ram, cumulative ? "TRAM" : "RAM", col_wid_ram, false);
+    printHdr(show_col_swap, cumulative ? "TSWAP" : "SWAP", col_wid_swap, false);
+    printHdr(show_col_cpu, cumulative ? "TCPU" : "CPU", col_wid_cpu, false);
+    printHdr(show_col_age, "AGE", col_wid_age, false);
+    printHdr(show_col_rio, cumulative ? "TIO-R" : "IO-R", col_wid_rio, false);
+    printHdr(show_col_wio, cumulative ? "TIO-W" : "IO-W", col_wid_wio, false);
+    printHdr(show_col_flt, "MINFLT", col_wid_flt, false);
+    printHdr(show_col_flt, "MAJFLT", col_wid_flt, false);
+
+    if (show_col_cmd)
+        line += "  COMMAND";
+
+    line += '\n';
+    putOut(line);
+}
+
+// --group cgroup: the counters of a cgroup are read from its own files,
+// once per cgroup instead of once per member process.
+struct Cgroup
+{
+    long long mem = -1, swap = -1, cpuUs = -1, readIO = -1, writeIO = -1;
+    set<string> children;
+    vector<int> rows; // Member processes
+};
+
+static void readCgroup(const string &path, Cgroup &cg)
+{
+    int dirFd = open((cgroupRoot + path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dirFd < 0)
+        return;
+
+    string line;
+
+    if (show_col_ram && !readLineInFile(dirFd, "memory.current", line))
+        cg.mem = strtoll(line.c_str(), nullptr, 10);
+
+    line.clear();
+    if (show_col_swap && !readLineInFile(dirFd, "memory.swap.current", line))
+        cg.swap = strtoll(line.c_str(), nullptr, 10);
+
+    // The first line is "usage_usec <N>".
+    line.clear();
+    if (show_col_cpu && !readLineInFile(dirFd, "cpu.stat", line) && !line.rfind("usage_usec ", 0))
+        cg.cpuUs = strtoll(line.c_str() + 11, nullptr, 10);
+
+    // A line per device: "<maj>:<min> rbytes=<N> wbytes=<N> ..."
+    int fd = (show_col_rio || show_col_wio) ? openat(dirFd, "io.stat", O_RDONLY | O_CLOEXEC) : -1;
+
+    if (fd >= 0)
+    {
+        string stat;
+        char buf[4096];
+        ssize_t len;
+
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+            stat.append(buf, len);
+
+        close(fd);
+
+        cg.readIO = cg.writeIO = 0;
+
+        for (size_t pos = 0; (pos = stat.find("rbytes=", pos)) != string::npos; pos += 7)
+            cg.readIO += strtoll(stat.c_str() + pos + 7, nullptr, 10);
+
+        for (size_t pos = 0; (pos = stat.find("wbytes=", pos)) != string::npos; pos += 7)
+            cg.writeIO += strtoll(stat.c_str() + pos + 7, nullptr, 10);
+    }
+
+    close(dirFd);
+}
+
+// The cgroups of the given rows, with their ancestors up to the root.
+static map<string, Cgroup> collectCgroups(const vector<int> &rows)
+{
+    map<string, Cgroup> cgroups;
+
+    for (int row : rows)
+    {
+        string path(procTable[row].cgroup.view());
+        cgroups[path].rows.push_back(row);
+
+        while (path != "/")
+        {
+            size_t slash = path.rfind('/');
+            string parent = slash ? path.substr(0, slash) : "/";
+
+            bool known = cgroups.count(parent);
+            cgroups[parent].children.insert(path);
+
+            if (known)
+                break;
+
+            path = parent;
+        }
+    }
+
+    for (auto &pair : cgroups)
+        readCgroup(pair.first, pair.second);
+
+    return cgroups;
+}
+
+static void printCgroup(const Cgroup &cg, const string &prefix, const string &name)
+{
+    line.clear();
+
+    for (bool show : {show_col_ppid, show_col_pgid, show_col_sid, show_col_pid})
+    {
+        if (show)
+            putCol("-", col_wid_pid);
+    }
+
+    if (show_col_tty)
+        putCol("-", col_wid_tty);
+    if (show_col_uid)
+    {
+        line += "  ";
+        putCol("-", col_wid_uid, true);
+    }
+    if (show_col_ram)
+        putCol(cg.mem < 0 ? "-" : toReadableSize(cg.mem), col_wid_ram);
+    if (show_col_swap)
+        putCol(cg.swap < 0 ? "-" : toReadableSize(cg.swap), col_wid_swap);
+    // Total usage, as there is no age for a percentage.
+    if (show_col_cpu)
+        putCol(cg.cpuUs < 0 ? "-" : toReadableTime(cg.cpuUs / 1000000), col_wid_cpu);
+    if (show_col_age)
+        putCol("-", col_wid_age);
+    if (show_col_rio)
+        putCol(cg.readIO < 0 ? "-" : toReadableSize(cg.readIO), col_wid_rio);
+    if (show_col_wio)
+        putCol(cg.writeIO < 0 ? "-" : toReadableSize(cg.writeIO), col_wid_wio);
+    if (show_col_flt)
+    {
+        putCol("-", col_wid_flt);
+        putCol("-", col_wid_flt);
+    }
+
+    line += "  ";
+    line += prefix;
+    line += name;
+
+    if (!noTrunc && TERM_COLS >= 0)
+        line.resize(fitColumns(line, TERM_COLS));
+
+    line += '\n';
+    putOut(line);
+}
+
+// A cgroup is followed by its member processes, and then its child cgroups.
+static void printCgroupTree(map<string, Cgroup> &cgroups, const string &path, vector<TreeEntry> &tree)
+{
+    Cgroup &cg = cgroups[path];
+    size_t procs = noProcs ? 0 : cg.rows.size();
+    unsigned int count = procs + cg.children.size();
+
+    auto prefix = [&](bool hasChildren) -> string
+    {
+        string str;
+
+        for (size_t i = 0; i < tree.size(); i++)
+        {
+            bool last = tree[i].siblingCount == tree[i].curSibling;
+
+            if (i + 1 < tree.size())
+                str += (last ? " " : ART_VERT) + " ";
+            else
+                str += (last ? ART_UP_RIGHT : ART_VERT_RIGHT) + ART_HORIZ + (hasChildren ? ART_DOWN_HORIZ : ART_HORIZ) + ART_HORIZ_LEFT;
+        }
+
+        return str;
+    };
+
+    printCgroup(cg, prefix(count > 0), path == "/" ? path : path.substr(path.rfind('/') + 1));
+
+    tree.push_back({count, 0});
+
+    for (size_t i = 0; i < procs; i++)
+    {
+        tree.back().curSibling++;
+        printProc(procTable[cg.rows[i]], prefix(false));
+    }
+
+    for (const string &child : cg.children)
+    {
+        tree.back().curSibling++;
+        printCgroupTree(cgroups, child, tree);
+    }
+
+    tree.pop_back();
+}
+
+static int printCgroups(set<pid_t> &pidList)
+{
+    vector<int> rows;
+
+    if (pidList.empty())
+    {
+        for (size_t i = 0; i < procTable.size(); i++)
+            rows.push_back(i);
+    }
+    else
+        rows = matchedRows(pidList);
+
+    if (lazyLoad && !noProcs)
+    {
+        vector<pid_t> pids;
+        for (int row : rows)
+            pids.push_back(procTable[row].pid);
+
+        loadRows(rows);
+
+        if (pruneProcs())
+            return 1;
+
+        rows.clear();
+
+        for (pid_t pid : pids)
+        {
+            int row = findRow(pid);
+            if (row >= 0 && (size_t)row < procTable.size())
+                rows.push_back(row);
+        }
+    }
+
+    if (procTable.empty())
+        return printErr("Failed to get any pid");
+
+    if (sortKey != SORT_NONE)
+        sort(rows.begin(), rows.end(), rowSortsBefore);
+    else
+        sort(rows.begin(), rows.end(), [](int a, int b)
+             { return procTable[a].pid < procTable[b].pid; });
+
+    map<string, Cgroup> cgroups = collectCgroups(rows);
+
+    printHeader();
+
+    vector<TreeEntry> tree;
+    printCgroupTree(cgroups, "/", tree);
+
+    flushOut();
+
+    return 0;
+}
+
+static int printProcs(char **args, int count)
+{
+    set<pid_t> pidList;
+
+    if (hasMatchArgs && parseArgs(args, count, pidList))
+        return 1;
+
+    if (groupKey == GROUP_CGROUP)
+        return printCgroups(pidList);
+
+    vector<pid_t> topPids;
+
+    // In a lazy scan, after the matched subtrees are loaded.
+    if (cumulative && !lazyLoad)
+        sumSubtrees();
+
+    if (topCount)
+    {
+        vector<int> rows;
+
+        if (pidList.empty())
+        {
+            for (size_t i = 0; i < procTable.size(); i++)
+                rows.push_back(i);
+        }
+        else
+            rows = matchedRows(pidList);
+
+        vector<int> top = selectTop(rows);
+        vector<char> added(procTable.size());
+
+        for (int row : top)
+        {
+            topPids.push_back(procTable[row].pid);
+            added[row] = true;
+        }
+
+        // The ancestors are printed too, and need to be loaded.
+        for (size_t i = 0; i < top.size() && !noTree; i++)
+        {
+            int parent = findRow(procTable[top[i]].ppid);
+
+            if (parent >= 0 && (size_t)parent < procTable.size() && !added[parent])
+            {
+                added[parent] = true;
+                top.push_back(parent);
+            }
+        }
+
+        if (lazyLoad)
+        {
+            // Some are loaded twice, but only a few.
+            loadRows(top);
+
+            if (pruneProcs())
+                return 1;
+
+            lazyLoad = false;
+        }
+
+        if (topPids.empty())
+            return printErr("Nothing matched");
+    }
+    else if (lazyLoad)
+    {
+        if (ancestors)
+        {
+            vector<int> rows = ancestorRows(pidList);
+            loadRows(rows);
+
+            if (pruneProcs())
+                return 1;
+        }
+        else if (loadProcs(pidList))
+            return 1;
+
+        lazyLoad = false;
+
+        if (cumulative)
+            sumSubtrees();
+
+        // Drop the ones which failed to load, as parseArgs() would have.
+        for (auto it = pidList.begin(); it != pidList.end();)
+        {
+            if (findProc(*it))
+            {
+                it++;
+                continue;
+            }
+
+            if (verbose && errMap.find(*it) != errMap.end())
+                printErr((string) "Pid " + to_string(*it) + ": " + errMap[*it]);
+
+            it = pidList.erase(it);
+        }
+
+        if (pidList.empty())
+            return verbose ? 1 : printErr("Nothing matched");
+    }
+
+    // If failed to get any PID from /proc due to e.g. permission denied.
+    if (procTable.empty())
+        return printErr("Failed to get any pid");
+
+    printHeader();
+
+    vector<int> rows;
+
+    shownRows.clear();
+
+    if (topCount)
+    {
+        shownRows.assign(rowPids.size(), false);
+
+        for (pid_t pid : topPids)
+        {
+            int row = findRow(pid);
+
+            // Exited after it was selected.
+            if (row < 0 || (size_t)row >= procTable.size())
+                continue;
+
+            if (noTree)
+                rows.push_back(row);
+
+            for (; row >= 0 && !shownRows[row]; row = (size_t)row < procTable.size() ? findRow(procTable[row].ppid) : -1)
+                shownRows[row] = true;
+        }
+    }
+    else if (ancestors)
+    {
+        shownRows.assign(rowPids.size(), false);
+
+        for (pid_t pid : pidList)
+        {
+            for (int row = findRow(pid); row >= 0 && !shownRows[row]; row = (size_t)row < procTable.size() ? findRow(procTable[row].ppid) : -1)
+                shownRows[row] = true;
+        }
+    }
+
+    if (sortKey != SORT_NONE)
+    {
+        for (size_t row = 0; row + 1 < childStart.size(); row++)
+            sort(childRows.begin() + childStart[row], childRows.begin() + childStart[row + 1], rowSortsBefore);
+    }
+
+    // If no args were provided, not hard-coding PID 0 or 1 as root process
+    // of the tree b/c it might not have been created due to e.g. permission denied.
+    if (topCount)
+    {
+        if (!noTree)
+            rows = rootRows;
+    }
+    else if (pidList.empty() || ancestors)
+        rows = rootRows;
+    else
+    {
+        for (pid_t pid : pidList)
+            rows.push_back(findRow(pid));
+
+        if (sortKey != SORT_NONE)
+            sort(rows.begin(), rows.end(), rowSortsBefore);
+    }
+
+    printedProcs.assign(rowPids.size(), false);
+    printedChildren.assign(rowPids.size(), false);
+
+    vector<TreeEntry> tree;
+
+    for (int row : rows)
+        printPidTree(row, tree);
+
+    flushOut();
+
+    return 0;
+}
+
+static volatile sig_atomic_t stopWatch = 0;
+
+static void onStopWatch(int)
+{
+    stopWatch = 1;
+}
+
+static long long monotonicMs()
+{
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Only the lines which changed since the previous frame are redrawn.
+static void drawFrame(string frame, vector<string> &prevFrame, bool tty)
+{
+    vector<string> lines;
+
+    size_t start = 0, end;
+    while ((end = frame.find('\n', start)) != string::npos)
+    {
+        lines.push_back(frame.substr(start, end - start));
+        start = end + 1;
+    }
+
+    if (!tty)
+    {
+        cout << frame << endl;
+        return;
+    }
+
+    struct winsize ws;
+    if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_row && lines.size() > ws.ws_row)
+        lines.resize(ws.ws_row);
+
+    ostringstream out;
+
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+        if (i >= prevFrame.size() || lines[i] != prevFrame[i])
+            out << "\033[" << i + 1 << ";1H" << lines[i] << "\033[K";
+    }
+
+    if (lines.size() < prevFrame.size())
+        out << "\033[" << lines.size() + 1 << ";1H\033[J";
+
+    cout << out.str() << flush;
+    prevFrame = lines;
+}
+
+// Keeps the process tree between the frames and only re-reads the fields
+// which change, except RAM and SWAP which are refreshed every memRefreshMs.
+static int watchProcs(char **args, int count, auto refresh)
+{
+    bool tty = isatty(STDOUT_FILENO);
+
+    struct sigaction sa = {};
+    sa.sa_handler = onStopWatch;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    vector<string> prevFrame;
+    long long memRefreshed = monotonicMs();
+    bool first = true;
+
+    while (!stopWatch)
+    {
+        struct winsize ws;
+        if (!ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_col != TERM_COLS)
+        {
+            TERM_COLS = ws.ws_col;
+            prevFrame.clear();
+        }
+
+        ostringstream frame;
+        streambuf *out = cout.rdbuf(frame.rdbuf());
+
+        // Errors become a part of the frame instead of being drawn over it.
+        streambuf *err = first ? nullptr : cerr.rdbuf(frame.rdbuf());
+
+        int res = printProcs(args, count);
+
+        cout.rdbuf(out);
+        if (err)
+            cerr.rdbuf(err);
+
+        if (res && first)
+            return 1;
+
+        // Only the errors for the given args are printed after the first frame.
+        verbose = false;
+
+        if (first && tty)
+            // Alternate screen, hide cursor.
+            cout << "\033[?1049h\033[?25l\033[H\033[2J";
+
+        first = false;
+
+        drawFrame(frame.str(), prevFrame, tty);
+
+        // Returns early (EINTR) on SIGINT.
+        poll(nullptr, 0, watchMs);
+
+        if (stopWatch)
+            break;
+
+        bool slow = monotonicMs() - memRefreshed >= memRefreshMs;
+        if (slow)
+            memRefreshed = monotonicMs();
+
+        if (refresh(slow))
+            break;
+    }
+
+    if (tty)
+        cout << "\033[?25h\033[?1049l" << flush;
+
+    return 0;
+}
+
+// The fields which are recorded, except age which follows the uptime.
+static bool procChanged(const Proc &a, const Proc &b)
+{
+    return a.ppid != b.ppid || a.pgid != b.pgid || a.sid != b.sid || a.uid != b.uid || a.minFlt != b.minFlt ||
+           a.majFlt != b.majFlt || a.cpuTime != b.cpuTime || a.startTime != b.startTime || a.pss != b.pss ||
+           a.swapPss != b.swapPss || a.readIO != b.readIO || a.writeIO != b.writeIO || a.tty != b.tty ||
+           a.cmdline != b.cmdline;
+}
+
+// Appends a frame every everyMs until SIGINT or SIGTERM. An existing
+// recording is continued. The oldest frames are overwritten to keep the
+// file within maxSize.
+static int recordProcs()
+{
+    int fd = open(recordFile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return printErrCode("Failed to open " + (string)recordFile);
+
+    auto fail = [fd](int res) -> int
+    {
+        close(fd);
+        return res;
+    };
+
+    uint32_t flags = (rssMem ? SNAP_RSS : 0) | (totalIo ? SNAP_TOTAL_IO : 0);
+
+    RecHeader hdr = {};
+    ssize_t len = pread(fd, &hdr, sizeof(hdr), 0);
+
+    if (len < 0)
+        return fail(printErrCode("Failed to read " + (string)recordFile));
+
+    if (!len)
+    {
+        if (!maxSize)
+            maxSize = 64 << 20;
+
+        memcpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+        hdr.version = REC_VERSION;
+        hdr.headerSize = sizeof(RecHeader);
+        hdr.recordSize = sizeof(SnapRecord);
+        hdr.flags = flags;
+        hdr.clkTck = SC_CLK_TCK;
+        hdr.capacity = maxSize > (long long)sizeof(RecHeader) ? (maxSize - sizeof(RecHeader)) & ~7ULL : 0;
+    }
+    else if (len != sizeof(hdr) || memcmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)))
+        return fail(printErr("Not a recording: " + (string)recordFile));
+    else if (hdr.version != REC_VERSION || hdr.headerSize != sizeof(RecHeader) || hdr.recordSize != sizeof(SnapRecord))
+        return fail(printErr("Unsupported recording version " + to_string(hdr.version) + ": " + recordFile));
+    else if (hdr.flags != flags || hdr.clkTck != (uint32_t)SC_CLK_TCK)
+        return fail(printErr("Recorded with different --rss or --total-io: " + (string)recordFile));
+    else if (maxSize && hdr.capacity != ((maxSize - sizeof(RecHeader)) & ~7ULL))
+        return fail(printErr("Recorded with a different --max-size: " + (string)recordFile));
+    else if (hdr.head > hdr.capacity || hdr.tail > hdr.capacity)
+        return fail(printErr("Corrupt recording: " + (string)recordFile));
+
+    auto corrupt = [&]() -> int
+    {
+        return fail(printErr("Corrupt recording: " + (string)recordFile));
+    };
+
+    auto writeHeader = [&]() -> bool
+    {
+        return writeAll(fd, &hdr, sizeof(hdr), 0);
+    };
+
+    // The oldest frame, with head moved to the ring start if it has wrapped.
+    auto headFrame = [&](FrameHeader &frame) -> bool
+    {
+        if (hdr.capacity - hdr.head < sizeof(frame))
+            hdr.head = 0;
+
+        for (int i = 0; i < 2; i++)
+        {
+            if (pread(fd, &frame, sizeof(frame), sizeof(RecHeader) + hdr.head) != sizeof(frame))
+                return false;
+
+            if (frame.type != FRAME_WRAP)
+                return frame.size >= sizeof(frame) && frame.size <= hdr.capacity - hdr.head;
+
+            hdr.head = 0;
+        }
+
+        return false;
+    };
+
+    auto dropOldest = [&]() -> bool
+    {
+        FrameHeader frame;
+
+        if (!headFrame(frame))
+            return false;
+
+        hdr.head += frame.size;
+
+        if (!--hdr.frameCount)
+            hdr.head = hdr.tail = 0;
+
+        return true;
+    };
+
+    // Ring offset for a frame of the given size, or -1 if the oldest frame is in the way.
+    auto placeFrame = [&](uint64_t size) -> int64_t
+    {
+        if (!hdr.frameCount)
+            return 0;
+
+        if (hdr.tail > hdr.head)
+            return hdr.capacity - hdr.tail >= size ? hdr.tail : (hdr.head >= size ? 0 : -1);
+
+        return hdr.tail < hdr.head && hdr.head - hdr.tail >= size ? hdr.tail : -1;
+    };
+
+    // The last recorded state of the processes.
+    unordered_map<pid_t, Proc> recorded;
+    int deltas = KEYFRAME_INTERVAL;
+    uint64_t deltaBytes = 0;
+
+    auto makeFrame = [&](bool key, string &buf)
+    {
+        vector<SnapRecord> records;
+        vector<int32_t> exited;
+        string strings;
+        unordered_map<const char *, uint32_t> stringOffsets;
+
+        for (Proc &proc : procTable)
+        {
+            auto it = recorded.find(proc.pid);
+
+            if (key || it == recorded.end() || procChanged(it->second, proc))
+                addSnapRecord(proc, records, strings, stringOffsets);
+        }
+
+        if (!key)
+        {
+            for (auto &pair : recorded)
+            {
+                if (!findProc(pair.first))
+                    exited.push_back(pair.first);
+            }
+        }
+
+        FrameHeader frame = {};
+        frame.type = key ? FRAME_KEY : FRAME_DELTA;
+        frame.recordCount = records.size();
+        frame.exitCount = exited.size();
+        frame.stringsSize = strings.length();
+        frame.time = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        frame.uptime = sInfo.uptime;
+
+        buf.assign((const char *)&frame, sizeof(frame));
+        buf.append((const char *)records.data(), records.size() * sizeof(SnapRecord));
+        buf.append((const char *)exited.data(), exited.size() * sizeof(int32_t));
+        buf.append(strings);
+        buf.resize((buf.length() + 7) & ~7);
+
+        ((FrameHeader *)buf.data())->size = buf.length();
+    };
+
+    auto addFrame = [&]() -> int
+    {
+        string buf;
+        bool key = deltas >= KEYFRAME_INTERVAL || deltaBytes >= hdr.capacity / 4;
+        makeFrame(key, buf);
+
+        int64_t pos;
+
+        while (true)
+        {
+            if (buf.length() > hdr.capacity)
+                return printErr("Frame of " + to_string(buf.length()) + " bytes does not fit in --max-size");
+
+            while ((pos = placeFrame(buf.length())) < 0)
+            {
+                if (!dropOldest())
+                    return corrupt();
+            }
+
+            // Deltas left at the head cannot be replayed without their keyframe.
+            FrameHeader frame;
+
+            while (hdr.frameCount && headFrame(frame) && frame.type != FRAME_KEY)
+            {
+                if (!dropOldest())
+                    return corrupt();
+            }
+
+            if (hdr.frameCount && frame.type != FRAME_KEY)
+                return corrupt();
+
+            if (key || hdr.frameCount)
+                break;
+
+            key = true;
+            makeFrame(key, buf);
+        }
+
+        if ((pos = placeFrame(buf.length())) < 0)
+            return corrupt();
+
+        // The dropped frames are out of the header before they are overwritten.
+        if (!writeHeader())
+            return printErrCode("Failed to write " + (string)recordFile);
+
+        if (!pos && hdr.tail && hdr.capacity - hdr.tail >= sizeof(FrameHeader))
+        {
+            FrameHeader wrap = {};
+            wrap.type = FRAME_WRAP;
+
+            if (!writeAll(fd, &wrap, sizeof(wrap), sizeof(RecHeader) + hdr.tail))
+                return printErrCode("Failed to write " + (string)recordFile);
+        }
+
+        if (!writeAll(fd, buf.data(), buf.length(), sizeof(RecHeader) + pos))
+            return printErrCode("Failed to write " + (string)recordFile);
+
+        hdr.tail = pos + buf.length();
+        hdr.frameCount++;
+
+        if (!writeHeader())
+            return printErrCode("Failed to write " + (string)recordFile);
+
+        deltas = key ? 0 : deltas + 1;
+        deltaBytes = key ? 0 : deltaBytes + buf.length();
+
+        recorded.clear();
+        for (Proc &proc : procTable)
+            recorded[proc.pid] = proc;
+
+        return 0;
+    };
+
+    struct sigaction sa = {};
+    sa.sa_handler = onStopWatch;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    long long next = monotonicMs();
+
+    while (!stopWatch)
+    {
+        if (addFrame())
+            return fail(1);
+
+        // Frames are aligned to the interval, not to the end of the previous one.
+        next += everyMs;
+        long long wait = next - monotonicMs();
+
+        if (wait < 0)
+            next -= wait;
+
+        // Returns early (EINTR) on SIGINT.
+        while (wait > 0 && !stopWatch)
+        {
+            poll(nullptr, 0, min(wait, 1000LL * 1000));
+            wait = next - monotonicMs();
+        }
+
+        if (stopWatch || refreshProcs(true))
+            break;
+
+        // The last recorded state is compared by handle.
+        compactStrings([&](auto relinkProc)
+                       {
+                           for (auto &pair : recorded)
+                               relinkProc(pair.second); });
+    }
+
+    return fail(stopWatch ? 0 : 1);
+}
+
+static int showProcs(char **args, int count)
+{
+    long long start = monotonicNs(), spent = scanNs + treeNs;
+
+    if (printProcs(args, count))
+        return 1;
+
+    if (timings)
+    {
+        cout.flush();
+        renderNs += monotonicNs() - start - (scanNs + treeNs - spent);
+
+        cerr << "Timings (" << procTable.size() << " processes): scan " << toFixed(scanNs / 1e6, 1, " ms")
+             << ", tree " << toFixed(treeNs / 1e6, 1, " ms") << ", render " << toFixed(renderNs / 1e6, 1, " ms") << endl;
+    }
+
+    if (!errMap.empty())
+        return verbose ? 1 : printErr("Failed to get " + to_string(errMap.size()) + " pids");
+
+    return 0;
+}
+
+// --daemon and --connect: the client sends its stdout and stderr along
+// with the request, and the daemon forks a child per request which prints
+// from its copy of the process table directly to them. The exit code of
+// the child is sent back.
+static constexpr uint32_t DAEMON_MAGIC = 0x50535444; // "PSTD"
+static constexpr uint32_t REQ_RESCAN = 1;
+static constexpr uint32_t MAX_REQ_SIZE = 1 << 20;
+
+struct DaemonRequest
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t size; // of the NUL separated args which follow
+};
+
+static int unixSocket(const char *path, sockaddr_un &addr)
+{
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return printErr("Socket path too long: " + (string)path);
+
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        printErrCode("Failed to create socket");
+
+    return fd;
+}
+
+static bool sendAll(int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t res = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+
+        if (res <= 0)
+            return false;
+
+        buf += res;
+        len -= res;
+    }
+
+    return true;
+}
+
+static bool recvAll(int fd, char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t res = recv(fd, buf, len, 0);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+
+        if (res <= 0)
+            return false;
+
+        buf += res;
+        len -= res;
+    }
+
+    return true;
+}
+
+static int connectDaemon(int argc, char **argv)
+{
+    sockaddr_un addr;
+    int fd = unixSocket(connectPath, addr);
+
+    if (fd < 0)
+        return 1;
+
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)))
+    {
+        printErrCode("Failed to connect to " + (string)connectPath);
+        close(fd);
+        return 1;
+    }
+
+    // The daemon parses the same options and args again.
+    string args;
+    for (int i = 0; i < argc; i++)
+        args.append(argv[i], strlen(argv[i]) + 1);
+
+    DaemonRequest req = {DAEMON_MAGIC, rescan ? REQ_RESCAN : 0, (uint32_t)args.length()};
+
+    int fds[] = {STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+
+    iovec iov = {&req, sizeof(req)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t code;
+
+    if (args.length() > MAX_REQ_SIZE || sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req) ||
+        !sendAll(fd, args.data(), args.length()) || !recvAll(fd, (char *)&code, sizeof(code)))
+    {
+        close(fd);
+        return printErr("Failed to get a response from " + (string)connectPath);
+    }
+
+    close(fd);
+    return code;
+}
+
+// Runs in the forked child, with the stdout and stderr of the client.
+static int serveRequest(vector<char *> &argv)
+{
+    // What the table holds is decided by the daemon.
+    bool kernel = !skipKernel, threads = !skipThreads, rss = rssMem, total = totalIo, taskstats = useTaskstats;
+    bool cols[] = {show_col_tty, show_col_uid, show_col_ram, show_col_swap, show_col_cpu, show_col_age, show_col_rio, show_col_wio, show_col_flt, show_col_cmd};
+    MemSource mem = memSource;
+    string root = procRoot;
+
+    int daemonJobs = jobs;
+
+    resetOpts();
+
+    // Full reinitialization of getopt.
+    optind = 0;
+
+    if (parseOpts(argv.size(), argv.data()))
+        return 1;
+
+    if ((!skipKernel && !kernel) || (!skipThreads && !threads))
+        return printErr("--kernel and --threads require the daemon to be started with them");
+
+    // pid, ppid, pgid and sid are always read.
+    bool reqCols[] = {show_col_tty, show_col_uid, show_col_ram, show_col_swap, show_col_cpu, show_col_age, show_col_rio, show_col_wio, show_col_flt, show_col_cmd || hasMatchArgs};
+
+    for (size_t i = 0; i < size(cols); i++)
+    {
+        if (reqCols[i] && !cols[i])
+            return printErr("The daemon was started without some of the columns (-o)");
+    }
+
+    if (rssMem != rss || totalIo != total || useTaskstats != taskstats || (memSource != MEM_AUTO && memSource != mem) ||
+        (procRoot != "/proc" && procRoot != root))
+        return printErr("--rss, --mem, --total-io, --taskstats and --proc-root must be the same as of the daemon");
+
+    memSource = mem;
+    procRoot = root;
+
+    if (!jobs)
+        jobs = daemonJobs;
+
+    initVars();
+
+    if (skipKernel && kernel)
+    {
+        for (Proc &proc : procTable)
+        {
+            if (proc.pid == 2 || proc.ppid == 2)
+            {
+                proc.failed = true;
+                skippedKernelProc.insert(proc.pid);
+            }
+        }
+
+        if (pruneProcs())
+            return 1;
+    }
+
+    return showProcs(argv.data() + optind, argv.size() - optind);
+}
+
+static int recvRequest(int conn, DaemonRequest &req, int *fds)
+{
+    // A client which connects and sends nothing does not block the daemon.
+    pollfd pfd = {conn, POLLIN, 0};
+
+    if (poll(&pfd, 1, 1000) != 1)
+        return 1;
+
+    char control[CMSG_SPACE(2 * sizeof(int))] = {};
+
+    iovec iov = {&req, sizeof(req)};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(req))
+        return 1;
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        return 1;
+
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+    if (req.magic != DAEMON_MAGIC || req.size > MAX_REQ_SIZE)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void handleRequest(int listenFd)
+{
+    int conn = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+
+    if (conn < 0)
+        return;
+
+    DaemonRequest req;
+    int fds[2];
+
+    if (recvRequest(conn, req, fds))
+    {
+        close(conn);
+        return;
+    }
+
+    if ((req.flags & REQ_RESCAN) && rescanProcs())
+        procTable.clear();
+
+    compactStrings();
+
+    pid_t pid = fork();
+
+    if (!pid)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        close(listenFd);
+
+        // The exit code is sent even if the client's stdout is closed early.
+        signal(SIGPIPE, SIG_IGN);
+
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        string args(req.size, '\0');
+        vector<char *> argv;
+
+        int32_t code = 1;
+
+        if (recvAll(conn, args.data(), args.length()) && !args.empty() && args.back() == '\0')
+        {
+            for (size_t i = 0; i < args.length(); i += strlen(args.data() + i) + 1)
+                argv.push_back(args.data() + i);
+
+            code = serveRequest(argv);
+        }
+
+        flushOut();
+        cout.flush();
+
+        sendAll(conn, (char *)&code, sizeof(code));
+        _exit(0);
+    }
+
+    if (pid < 0 && verbose)
+        printErrCode("Failed to fork");
+
+    close(conn);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Keeps the process table like watch mode, and answers the requests in
+// between the refreshes until SIGINT or SIGTERM.
+static int serveDaemon()
+{
+    sockaddr_un addr;
+    int fd = unixSocket(socketPath, addr);
+
+    if (fd < 0)
+        return 1;
+
+    auto fail = [fd](int res) -> int
+    {
+        close(fd);
+        return res;
+    };
+
+    // A socket left behind by a daemon which is gone is replaced.
+    if (!connect(fd, (sockaddr *)&addr, sizeof(addr)))
+        return fail(printErr("Daemon already listening on " + (string)socketPath));
+
+    if (errno == ECONNREFUSED)
+        unlink(socketPath);
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN))
+        return fail(printErrCode("Failed to listen on " + (string)socketPath));
+
+    struct sigaction sa = {};
+    sa.sa_handler = onStopWatch;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    // The children are not waited for.
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGCHLD, &sa, nullptr);
+
+    int res = scanProcs();
+
+    long long next = monotonicMs() + refreshMs, memRefreshed = monotonicMs();
+
+    while (!res && !stopWatch)
+    {
+        pollfd pfd = {fd, POLLIN, 0};
+
+        // Returns early (EINTR) on SIGINT.
+        if (poll(&pfd, 1, max(next - monotonicMs(), 0LL)) == 1)
+            handleRequest(fd);
+
+        if (stopWatch || monotonicMs() < next)
+            continue;
+
+        bool slow = monotonicMs() - memRefreshed >= memRefreshMs;
+        if (slow)
+            memRefreshed = monotonicMs();
+
+        res = refreshProcs(slow);
+        next = monotonicMs() + refreshMs;
+
+        compactStrings();
+        updateAges();
+    }
+
+    unlink(socketPath);
+    return fail(res);
+}
+
+// --exporter: the metrics are summed per group, so that the number of
+// series does not grow with the number of processes.
+struct MetricGroup
+{
+    string labels;
+    long long procs = 0, ram = 0, swap = 0, cpuMs = 0, readIO = 0, writeIO = 0;
+};
+
+// Prometheus label value
+static string promEscape(string_view str)
+{
+    string out;
+
+    for (char c : str)
+    {
+        if (c == '\\' || c == '"')
+            out += '\\';
+
+        if (c == '\n')
+            out += "\\n";
+        else
+            out += c;
+    }
+
+    return out;
+}
+
+static void addToGroup(MetricGroup &group, const Proc &proc)
+{
+    group.procs++;
+
+    // Unknown values (kernel threads, or not shown) are left out.
+    if (proc.pss > 0)
+        group.ram += proc.pss;
+    if (proc.swapPss > 0)
+        group.swap += proc.swapPss;
+    if (proc.cpuTime > 0)
+        group.cpuMs += proc.cpuTime;
+    if (proc.readIO > 0)
+        group.readIO += proc.readIO;
+    if (proc.writeIO > 0)
+        group.writeIO += proc.writeIO;
+}
 
-static int createProc(Proc &proc, pid_t pid, pid_t tid = 0)
+static vector<MetricGroup> groupProcs(const vector<pid_t> &roots)
 {
-    if (skipKernel && pid == 2)
-    {
-        skippedKernelProc.insert(pid);
-        return 0;
-    }
+    vector<MetricGroup> groups;
 
-    proc.pid = pid;
-    proc.tid = tid;
-
-    parseStat(proc);
-    if (!tid && skipKernel && proc.ppid == 2)
+    if (groupKey == GROUP_CGROUP)
     {
-        skippedKernelProc.insert(pid);
-        return 0;
-    }
+        vector<int> rows;
+        for (size_t i = 0; i < procTable.size(); i++)
+            rows.push_back(i);
 
-    parseStatus(proc);
-    getCmdline(proc);
-    if (!tid)
-        getPss(proc);
-    getIo(proc);
+        // The values are of the whole cgroup, including its children.
+        for (auto &pair : collectCgroups(rows))
+        {
+            const Cgroup &cg = pair.second;
 
-    if (tid || proc.failed)
-        return 0;
+            groups.push_back({"cgroup=\"" + promEscape(pair.first) + "\"", (long long)cg.rows.size(), cg.mem, cg.swap,
+                              cg.cpuUs < 0 ? -1 : cg.cpuUs / 1000, cg.readIO, cg.writeIO});
+        }
+
+        return groups;
+    }
 
-    if (!procMap.insert({proc.pid, proc}).second)
-        return printErr("Failed to build proc map");
+    if (groupKey == GROUP_UID)
+    {
+        map<uid_t, MetricGroup> byUid;
 
-    list<Proc> children;
+        for (Proc &proc : procTable)
+            addToGroup(byUid[proc.uid], proc);
 
-    if (childMap.find(proc.ppid) != childMap.end())
-        children = childMap[proc.ppid];
+        for (auto &pair : byUid)
+        {
+            pair.second.labels = "uid=\"" + to_string(pair.first) + "\",user=\"" + promEscape(getUserName(pair.first)) + "\"";
+            groups.push_back(pair.second);
+        }
 
-    children.push_back(proc);
-    childMap[proc.ppid] = children;
+        return groups;
+    }
 
-    return 0;
-}
+    auto label = [](const Proc &proc) -> string
+    {
+        // The executable name, without the path and the args.
+        string_view cmd = proc.cmdline.view();
+        cmd = cmd.substr(0, cmd.find(' '));
+        cmd = cmd.substr(cmd.rfind('/') + 1);
+        return "pid=\"" + to_string(proc.pid) + "\",cmd=\"" + promEscape(cmd) + "\"";
+    };
 
-static void matchCmd(string str, set<pid_t> &pidList)
-{
-    pid_t myPid = getpid();
+    // A process is counted once, even under nested roots.
+    vector<char> counted(procTable.size());
+    vector<int> stack;
 
-    bool matched = false;
-    for (auto pair : procMap)
+    for (pid_t pid : roots)
     {
-        Proc proc = pair.second;
+        int row = findRow(pid);
 
-        if (proc.pid == myPid)
+        if (row < 0)
             continue;
 
-        char *cmd = (char *)proc.cmdline.c_str();
-
-        if (exeOnly)
+        // The root itself, unless it is not in the table (e.g. pid 0).
+        if ((size_t)row < procTable.size() && !counted[row])
         {
-            char *p = strchr(cmd, ' ');
-            if (p)
-                *p = '\0';
+            counted[row] = true;
+            groups.push_back({label(procTable[row])});
+            addToGroup(groups.back(), procTable[row]);
         }
 
-        if (strstr(cmd, str.c_str()))
+        for (int i = childStart[row]; i < childStart[row + 1]; i++)
         {
-            matched = true;
-            pidList.insert(proc.pid);
-        }
-    }
+            int child = childRows[i];
 
-    if (verbose && !matched)
-        printErr((string) "No match for process name: " + str);
-}
+            if (counted[child])
+                continue;
 
-static int parseArgs(char **args, int size, set<pid_t> &pidList)
-{
-    for (int i = 0; i < size; i++)
-    {
-        string str = args[i];
+            groups.push_back({label(procTable[child])});
+            stack.push_back(child);
 
-        if (!noPid && isNumber(str, "pid", false))
-        {
-            pid_t pid = stoi(str);
-            if (procMap.find(pid) != procMap.end())
-                pidList.insert(pid);
-            else if (verbose)
+            while (!stack.empty())
             {
-                if (skipKernel && skippedKernelProc.find(pid) != skippedKernelProc.end())
-                    printErr((string) "Ignoring pid " + str);
-                else if (errMap.find(pid) != errMap.end())
-                    printErr((string) "Pid " + str + ": " + errMap[pid]);
-                else
-                    printErr((string) "Pid " + str + " not found");
+                int cur = stack.back();
+                stack.pop_back();
+
+                if (counted[cur])
+                    continue;
+
+                counted[cur] = true;
+                addToGroup(groups.back(), procTable[cur]);
+
+                for (int j = childStart[cur]; j < childStart[cur + 1]; j++)
+                    stack.push_back(childRows[j]);
             }
         }
-        else
-            matchCmd(str, pidList);
     }
 
-    if (pidList.empty())
-        return verbose ? 1 : printErr("Nothing matched");
-
-    return 0;
+    return groups;
 }
 
-static auto constexpr MB = 1000000.0;
-static auto constexpr GB = 1000000000.0;
-
-static string toReadableSize(long bytes)
+static string renderMetrics(const vector<pid_t> &roots)
 {
-    if (bytes < MB)
-        return to_string(bytes / 1000) + " KB";
+    vector<MetricGroup> groups = groupProcs(roots);
+    string out;
+
+    // Negative values are unknown, e.g. a cgroup without the controller.
+    auto family = [&](bool show, const char *name, const char *help, long long MetricGroup::*field, bool ms = false)
+    {
+        if (!show)
+            return;
 
-    ostringstream oss;
+        out += "# HELP " + (string)name + " " + help + "\n";
+        out += "# TYPE " + (string)name + " gauge\n";
 
-    if (bytes < GB)
-        oss << fixed << setprecision(1) << bytes / MB << " MB";
-    else
-        oss << fixed << setprecision(1) << bytes / GB << " GB";
+        for (MetricGroup &group : groups)
+        {
+            long long value = group.*field;
+
+            if (value >= 0)
+                out += (string)name + "{" + group.labels + "} " + (ms ? toFixed(value / 1000.0, 3, "") : to_string(value)) + "\n";
+        }
+    };
+
+    const char *ram = rssMem ? "RSS of the processes in the group." : "PSS of the processes in the group.";
+    const char *swap = rssMem ? "Swap of the processes in the group." : "Swap PSS of the processes in the group.";
+    const char *cpu = "CPU time of the live processes in the group.";
+    const char *rio = "Storage reads of the live processes in the group.";
+    const char *wio = "Storage writes of the live processes in the group.";
 
-    return oss.str();
+    if (groupKey == GROUP_CGROUP)
+    {
+        ram = "Memory charged to the cgroup.";
+        swap = "Swap charged to the cgroup.";
+        cpu = "CPU time of the cgroup.";
+        rio = "Storage reads of the cgroup.";
+        wio = "Storage writes of the cgroup.";
+    }
+
+    family(true, "pst_processes", groupKey == GROUP_CGROUP ? "Number of processes in the cgroup itself." : "Number of processes in the group.", &MetricGroup::procs);
+    family(show_col_ram, "pst_ram_bytes", ram, &MetricGroup::ram);
+    family(show_col_swap, "pst_swap_bytes", swap, &MetricGroup::swap);
+    family(show_col_cpu, "pst_cpu_seconds", cpu, &MetricGroup::cpuMs, true);
+    family(show_col_rio, "pst_read_bytes", rio, &MetricGroup::readIO);
+    family(show_col_wio, "pst_write_bytes", wio, &MetricGroup::writeIO);
+
+    return out;
 }
 
-static string toReadableTime(long sec)
+static int listenSocket(const char *addr)
 {
-    int d, h, m;
+    // A Unix socket path, or a loopback address.
+    if (strchr(addr, '/'))
+    {
+        sockaddr_un un;
+        int fd = unixSocket(addr, un);
 
-    d = sec / (60 * 60 * 24);
-    sec -= d * (60 * 60 * 24);
+        if (fd < 0)
+            return -1;
 
-    h = sec / (60 * 60);
-    sec -= h * (60 * 60);
+        if (!connect(fd, (sockaddr *)&un, sizeof(un)))
+        {
+            close(fd);
+            printErr("Already listening on " + (string)addr);
+            return -1;
+        }
 
-    m = sec / 60;
-    sec -= m * 60;
+        if (errno == ECONNREFUSED)
+            unlink(addr);
 
-    if (d > 0)
-        return to_string(d) + "d" + (h > 0 ? to_string(h) + "h" : "");
+        if (bind(fd, (sockaddr *)&un, sizeof(un)) || listen(fd, SOMAXCONN))
+        {
+            printErrCode("Failed to listen on " + (string)addr);
+            close(fd);
+            return -1;
+        }
 
-    if (h > 0)
-        return to_string(h) + "h" + (m > 0 ? to_string(m) + "m" : "");
+        return fd;
+    }
 
-    if (m > 0)
-        return to_string(m) + "m" + (sec > 0 ? to_string(sec) + "s" : "");
+    string str = addr;
+    size_t colon = str.rfind(':');
+    string host = colon == string::npos ? "" : str.substr(0, colon);
+    string port = colon == string::npos ? "" : str.substr(colon + 1);
 
-    return to_string(sec) + "s";
-}
+    if (host.length() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.length() - 2);
 
-static string toPercentage(long dividend, long divisor)
-{
-    ostringstream oss;
-    oss << fixed << setprecision(2) << 100 * dividend / (float)divisor << "%";
-    return oss.str();
-}
+    if (host.empty() || host == "localhost")
+        host = "127.0.0.1";
 
-static wstring_convert<std::codecvt_utf8_utf16<wchar_t>> WCHAR_CONVERTER;
+    sockaddr_in in4 = {};
+    sockaddr_in6 in6 = {};
+    sockaddr *sa = nullptr;
+    socklen_t len = 0;
 
-static void printProc(Proc proc, string prefix)
-{
-    ostringstream line;
+    bool validPort = isNumber(port, "port", false) && port.length() <= 5 && stoi(port) <= 65535;
 
-    if (show_col_ppid)
-        line << setw(col_wid_pid) << proc.ppid;
-    if (show_col_pgid)
-        line << setw(col_wid_pid) << proc.pgid;
-    if (show_col_sid)
-        line << setw(col_wid_pid) << proc.sid;
-    if (show_col_pid)
-        line << setw(col_wid_pid) << proc.pid;
-    if (!skipThreads)
-        line << setw(col_wid_pid) << (proc.tid ? to_string(proc.tid) : "-");
-    if (show_col_tty)
-        line << setw(col_wid_tty) << (proc.tid ? "-" : proc.tty);
-    if (show_col_uid)
-        line << "  " << setw(col_wid_uid) << left << getUserName(proc.uid) << right;
-    if (show_col_ram)
-        line << setw(col_wid_ram) << (proc.tid ? "-" : (proc.pid == 2 || proc.ppid == 2 ? "-" : toReadableSize(proc.pss)));
-    if (show_col_swap)
-        line << setw(col_wid_swap) << (proc.tid ? "-" : (proc.pid == 2 || proc.ppid == 2 ? "-" : toReadableSize(proc.swapPss)));
-    if (show_col_cpu)
-        line << setw(col_wid_cpu) << (cpuTime ? toReadableTime(proc.cpuTime / 1000) : toPercentage(proc.cpuTime, proc.age));
-    if (show_col_age)
-        line << setw(col_wid_age) << toReadableTime(proc.age / 1000);
-    if (show_col_rio)
-        line << setw(col_wid_rio) << toReadableSize(proc.readIO);
-    if (show_col_wio)
-        line << setw(col_wid_wio) << toReadableSize(proc.writeIO);
-    if (show_col_cmd)
-        line << "  " << prefix << proc.cmdline;
+    if (validPort && inet_pton(AF_INET, host.c_str(), &in4.sin_addr) == 1 && (ntohl(in4.sin_addr.s_addr) >> 24) == 127)
+    {
+        in4.sin_family = AF_INET;
+        in4.sin_port = htons(stoi(port));
+        sa = (sockaddr *)&in4;
+        len = sizeof(in4);
+    }
+    else if (validPort && inet_pton(AF_INET6, host.c_str(), &in6.sin6_addr) == 1 && IN6_IS_ADDR_LOOPBACK(&in6.sin6_addr))
+    {
+        in6.sin6_family = AF_INET6;
+        in6.sin6_port = htons(stoi(port));
+        sa = (sockaddr *)&in6;
+        len = sizeof(in6);
+    }
 
-    string s = line.str();
+    if (!sa)
+    {
+        printErr("Bad argument with --listen (a socket path or a loopback host:port): " + str);
+        return -1;
+    }
 
-    if (noTrunc)
-        cout << s << endl;
-    else
+    int fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) || bind(fd, sa, len) || listen(fd, SOMAXCONN))
     {
-        wstring ws = WCHAR_CONVERTER.from_bytes(s);
-        cout << s.substr(0, TERM_COLS + s.length() - ws.length()) << endl;
+        printErrCode("Failed to listen on " + str);
+        if (fd >= 0)
+            close(fd);
+        return -1;
     }
+
+    return fd;
 }
 
-struct TreeEntry
+// A minimal HTTP/1.0 responder, one scrape at a time.
+static void answerScrape(int listenFd, auto getBody)
 {
-    unsigned int siblingCount, curSibling;
-};
+    int conn = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
 
-static void printPidTree(pid_t pid, list<TreeEntry> tree)
-{
-    // PID 0 is not a real parent. Or in case if PIDs from procMap
-    // are already consumed being child of a previously printed PID.
-    bool hasParent = procMap.find(pid) != procMap.end();
+    if (conn < 0)
+        return;
 
-    bool hasChildren = !noTree && childMap.find(pid) != childMap.end();
+    // Only the request line is needed. A slow client is dropped.
+    string req;
+    char buf[1024];
+    pollfd pfd = {conn, POLLIN, 0};
 
-    if (hasParent)
+    while (req.find("\r\n") == string::npos && req.length() < 8192 && poll(&pfd, 1, 1000) == 1)
     {
-        string prefix = "", tidPrefix = "";
-        int iter = 1, size = tree.size();
-        bool last;
+        ssize_t len = recv(conn, buf, sizeof(buf), 0);
+        if (len <= 0)
+            break;
+        req.append(buf, len);
+    }
 
-        for (struct TreeEntry te : tree)
-        {
-            last = te.siblingCount == te.curSibling;
-            if (iter++ == size)
-            {
-                prefix += last ? ART_UP_RIGHT : ART_VERT_RIGHT;
-                prefix += ART_HORIZ;
-                prefix += hasChildren ? ART_DOWN_HORIZ : ART_HORIZ;
-                prefix += ART_HORIZ_LEFT;
+    string status = "200 OK", body;
 
-                tidPrefix += last ? " " : ART_VERT;
-                tidPrefix += " ";
-                tidPrefix += hasChildren ? ART_VERT : " ";
-                tidPrefix += " ";
-            }
-            else
-            {
-                prefix += (last ? " " : ART_VERT) + " ";
-                tidPrefix += (last ? " " : ART_VERT) + " ";
-            }
-        }
+    if (req.rfind("GET / ", 0) && req.rfind("GET /metrics ", 0))
+        status = "404 Not Found";
+    else
+        body = getBody();
 
-        Proc proc = procMap[pid];
-        printProc(proc, prefix);
+    string resp = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                  to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
 
-        procMap.erase(pid);
+    sendAll(conn, resp.data(), resp.length());
+    close(conn);
+}
 
-        if (!skipThreads && pid != 2 && proc.ppid != 2)
-        {
-            list<Proc> threads;
-            auto cb = [&](pid_t tid) -> bool
-            {
-                Proc proc;
-                createProc(proc, pid, tid);
+static int runExporter(char **args, int count)
+{
+    vector<pid_t> roots;
 
-                if (!proc.failed)
-                    threads.push_back(proc);
+    for (int i = 0; i < count; i++)
+        roots.push_back(stoi(args[i]));
 
-                return true;
-            };
+    if (roots.empty())
+        roots.push_back(1);
 
-            parseProcTree("/proc/" + to_string(pid) + "/task", cb);
+    if (!listenAddr)
+    {
+        putOut(renderMetrics(roots));
+        flushOut();
 
-            int i = 0, size = threads.size();
-            string threadPrefix;
+        if (!errMap.empty())
+            return verbose ? 1 : printErr("Failed to get " + to_string(errMap.size()) + " pids");
 
-            for (Proc proc : threads)
-            {
-                threadPrefix = tidPrefix;
+        return 0;
+    }
 
-                if (++i == size)
-                    threadPrefix += hasChildren && tree.empty() ? ART_VERT_RIGHT : ART_UP_RIGHT;
-                else
-                    threadPrefix += ART_VERT_RIGHT;
+    int fd = listenSocket(listenAddr);
 
-                threadPrefix += ART_HORIZ_LEFT;
+    if (fd < 0)
+        return 1;
 
-                printProc(proc, threadPrefix);
-            }
-        }
-    }
+    struct sigaction sa = {};
+    sa.sa_handler = onStopWatch;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
 
-    if (!hasChildren)
-        return;
+    // The table is refreshed on a scrape, at most once per refreshMs, and
+    // the rendered metrics are reused until then.
+    long long refreshed = monotonicMs(), memRefreshed = refreshed;
+    string body = renderMetrics(roots);
+    int res = 0;
 
-    auto children = childMap[pid];
-    childMap.erase(pid);
+    auto getBody = [&]() -> string
+    {
+        if (monotonicMs() - refreshed < refreshMs)
+            return body;
 
-    if (hasParent)
-        tree.push_back({.siblingCount = (unsigned int)children.size(), .curSibling = 1});
+        bool slow = monotonicMs() - memRefreshed >= memRefreshMs;
+        if (slow)
+            memRefreshed = monotonicMs();
 
-    for (Proc proc : children)
-    {
-        printPidTree(proc.pid, tree);
-        if (hasParent)
-            tree.back().curSibling++;
-    }
-}
+        // A process may have moved to another cgroup.
+        if ((res = groupKey == GROUP_CGROUP ? rescanProcs() : refreshProcs(slow)))
+            stopWatch = 1;
 
-static void printHeader()
-{
-    if (noHeader)
-        return;
+        compactStrings();
 
-    auto printHdr = [](bool show, string title, int width, bool leftAlign)
-    {
-        if (show)
-        {
-            if (leftAlign)
-                cout << "  " << setw(width) << left << title << right;
-            else
-                cout << setw(width) << title;
-        }
+        refreshed = monotonicMs();
+        body = renderMetrics(roots);
+        return body;
     };
 
-    printHdr(show_col_ppid, "PPID", col_wid_pid, false);
-    printHdr(show_col_pgid, "PGID", col_wid_pid, false);
-    printHdr(show_col_sid, "SID", col_wid_pid, false);
-    printHdr(show_col_pid, "PID", col_wid_pid, false);
-    printHdr(!skipThreads, "TID", col_wid_pid, false);
-    printHdr(show_col_tty, "TTY", col_wid_tty, false);
-    printHdr(show_col_uid, "UID", col_wid_uid, true);
-    printHdr(show_col_ram, "RAM", col_wid_ram, false);
-    printHdr(show_col_swap, "SWAP", col_wid_swap, false);
-    printHdr(show_col_cpu, "CPU", col_wid_cpu, false);
-    printHdr(show_col_age, "AGE", col_wid_age, false);
-    printHdr(show_col_rio, "IO-R", col_wid_rio, false);
-    printHdr(show_col_wio, "IO-W", col_wid_wio, false);
+    while (!stopWatch)
+    {
+        pollfd pfd = {fd, POLLIN, 0};
 
-    if (show_col_cmd)
-        cout << "  COMMAND";
+        // Returns early (EINTR) on SIGINT.
+        if (poll(&pfd, 1, -1) == 1)
+            answerScrape(fd, getBody);
+    }
 
-    cout << endl;
+    if (strchr(listenAddr, '/'))
+        unlink(listenAddr);
+
+    close(fd);
+    return res;
 }
 
 /////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv)
 {
+    resetOpts();
+
     if (argc > 1 && parseOpts(argc, argv))
         return 1;
 
@@ -1197,6 +6229,12 @@ int main(int argc, char **argv)
 
     initVars();
 
+    if (!jobs && (jobs = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        jobs = 1;
+
+    if (connectPath)
+        return connectDaemon(argc, argv);
+
     bool origVerbose = verbose;
     bool origShowCmd = show_col_cmd;
 
@@ -1209,40 +6247,88 @@ int main(int argc, char **argv)
         show_col_cmd = true;
     }
 
-    set<pid_t> pidList;
+    if (useTaskstats && initTaskstats())
+    {
+        if (verbose)
+            printErrCode("Failed to query taskstats, reading procfs");
 
-    if (parseProcTree("/proc", [](pid_t pid) -> bool
-                      {
-                        Proc proc;
-                        return !createProc(proc, pid); }))
-        return 1;
+        useTaskstats = false;
+    }
 
-    verbose = origVerbose;
-    show_col_cmd = origShowCmd;
+    // Subscribe before the initial scan so that no event is missed in between.
+    int eventsFd = -1;
 
-    if (hasMatchArgs && parseArgs(argv + optind, argc - optind, pidList))
-        return 1;
+    if (procEvents && (eventsFd = openProcEvents()) < 0 && verbose)
+        printErrCode("Failed to listen to proc events, polling /proc");
 
-    // If failed to get any PID from /proc due to e.g. permission denied.
-    if (childMap.empty())
-        return printErr("Failed to get any pid");
+    // Sampling and watching need all the fields of all the processes.
+    // The subtree sums of --top need all the processes.
+    // Only the light files are read for all the processes with --no-procs.
+    lazyLoad = ((hasMatchArgs || topCount) && !intervalMs && !watchMs && !loadFile && !(cumulative && topCount) && !exporter) || noProcs;
 
-    printHeader();
+    // Only the printed processes are read with a direct lookup.
+    if (directLookup)
+        lazyLoad = false;
 
-    // If no args were provided.
-    if (pidList.empty())
+    if (daemonMode)
+        return serveDaemon();
+
+    if (loadFile)
+    {
+        long long start = monotonicNs(), tree = treeNs;
+
+        if (loadSnapshot())
+            return 1;
+
+        scanNs += monotonicNs() - start - (treeNs - tree);
+    }
+    else if (directLookup)
     {
-        // Not hard-coding PID 0 or 1 as root process of the tree b/c it
-        // might not have been created due to e.g. permission denied.
-        for (auto pair : childMap)
-            pidList.insert(pair.first);
+        if (scanPids(argv + optind, argc - optind))
+            return 1;
     }
+    else if (scanProcs() || (intervalMs && sampleInterval()))
+        return 1;
 
-    for (pid_t pid : pidList)
-        printPidTree(pid, {});
+    if (recordFile)
+        return recordProcs();
 
-    if (!errMap.empty())
-        return verbose ? 1 : printErr("Failed to get " + to_string(errMap.size()) + " pids");
+    if (saveFile)
+    {
+        if (saveSnapshot())
+            return 1;
 
-    return 0;
+        if (!errMap.empty())
+            return verbose ? 1 : printErr("Failed to get " + to_string(errMap.size()) + " pids");
+
+        return 0;
+    }
+
+    verbose = origVerbose;
+    show_col_cmd = origShowCmd;
+
+    if (exporter)
+        return runExporter(argv + optind, argc - optind);
+
+    if (watchMs)
+    {
+        auto refresh = [&](bool slow) -> int
+        {
+            show_col_cmd = hasMatchArgs || origShowCmd;
+            int err = eventsFd < 0 ? refreshProcs(slow) : applyProcEvents(eventsFd, slow);
+            show_col_cmd = origShowCmd;
+
+            if (!err)
+            {
+                compactStrings();
+                updateAges();
+            }
+
+            return err;
+        };
+
+        return watchProcs(argv + optind, argc - optind, refresh);
+    }
+
+    return showProcs(argv + optind, argc - optind);
 }